@@ -69,6 +69,40 @@ def bm_switch(loops):
     end = pyperf.perf_counter()
     return end - begin
 
+def _deep(depth, then):
+    # Recurse through a C function so that each level uses
+    # some C stack (a pure-Python call doesn't on 3.11+).
+    if depth:
+        return next(map(_deep, (depth - 1,), (then,)))
+    return then()
+
+# Each level is about 500 bytes of C stack, so these are roughly
+# 1KB, 20KB and 60KB of stack that has to be copied on each switch
+# when sharing the C stack.
+SWITCH_DEPTHS = (0, 40, 120)
+DEDICATED_STACK_SIZE = 1024 * 1024
+
+def bm_switch_at_depth(loops, depth, stack_size):
+    class G(greenlet.greenlet):
+        other = None
+        def run(self):
+            _deep(depth, self.ping_pong)
+
+        def ping_pong(self):
+            o = self.other
+            for _ in range(SWITCH_INNER_LOOPS):
+                o.switch()
+
+    begin = pyperf.perf_counter()
+    for _ in range(loops):
+        gl1 = G(stack_size=stack_size)
+        gl2 = G(stack_size=stack_size)
+        gl1.other = gl2
+        gl2.other = gl1
+        gl1.switch()
+    end = pyperf.perf_counter()
+    return end - begin
+
 CREATE_INNER_LOOPS = 10
 def bm_create(loops):
     gl = greenlet.greenlet
@@ -87,6 +121,90 @@ def bm_create(loops):
     end = pyperf.perf_counter()
     return end - begin
 
+def _noop():
+    pass
+
+def bm_create_with_run(loops):
+    gl = greenlet.greenlet
+    run = _noop
+    begin = pyperf.perf_counter()
+    for _ in range(loops):
+        gl(run)
+        gl(run)
+        gl(run)
+        gl(run)
+        gl(run)
+        gl(run)
+        gl(run)
+        gl(run)
+        gl(run)
+        gl(run)
+    end = pyperf.perf_counter()
+    return end - begin
+
+def bm_create_with_run_and_parent(loops):
+    gl = greenlet.greenlet
+    run = _noop
+    parent = greenlet.getcurrent()
+    begin = pyperf.perf_counter()
+    for _ in range(loops):
+        gl(run, parent)
+        gl(run, parent)
+        gl(run, parent)
+        gl(run, parent)
+        gl(run, parent)
+        gl(run, parent)
+        gl(run, parent)
+        gl(run, parent)
+        gl(run, parent)
+        gl(run, parent)
+    end = pyperf.perf_counter()
+    return end - begin
+
+def _return_value():
+    # Make a call so the greenlet pushes a frame of its own
+    # (on 3.11+ that's on its own frame data stack).
+    return len(())
+
+FINISH_INNER_LOOPS = 10
+def bm_create_run_finish(loops):
+    gl = greenlet.greenlet
+    run = _return_value
+    begin = pyperf.perf_counter()
+    for _ in range(loops):
+        gl(run).switch()
+        gl(run).switch()
+        gl(run).switch()
+        gl(run).switch()
+        gl(run).switch()
+        gl(run).switch()
+        gl(run).switch()
+        gl(run).switch()
+        gl(run).switch()
+        gl(run).switch()
+    end = pyperf.perf_counter()
+    return end - begin
+
+def _suspend():
+    greenlet.getcurrent().parent.switch()
+
+KILL_INNER_LOOPS = 1000
+def bm_kill(loops, killall):
+    gl = greenlet.greenlet
+    duration = 0
+    for _ in range(loops):
+        glets = [gl(_suspend) for _ in range(KILL_INNER_LOOPS)]
+        for g in glets:
+            g.switch()
+        begin = pyperf.perf_counter()
+        if killall:
+            greenlet.killall(glets)
+        else:
+            for g in glets:
+                g.throw()
+        duration += pyperf.perf_counter() - begin
+    return duration
+
 if __name__ == '__main__':
     runner = pyperf.Runner()
     runner.bench_time_func(
@@ -94,6 +212,33 @@ if __name__ == '__main__':
         bm_create,
         inner_loops=CREATE_INNER_LOOPS
     )
+    runner.bench_time_func(
+        'create a greenlet with run',
+        bm_create_with_run,
+        inner_loops=CREATE_INNER_LOOPS
+    )
+    runner.bench_time_func(
+        'create a greenlet with run and parent',
+        bm_create_with_run_and_parent,
+        inner_loops=CREATE_INNER_LOOPS
+    )
+    runner.bench_time_func(
+        'create, run and finish a greenlet',
+        bm_create_run_finish,
+        inner_loops=FINISH_INNER_LOOPS
+    )
+    runner.bench_time_func(
+        'kill greenlets with throw()',
+        bm_kill,
+        False,
+        inner_loops=KILL_INNER_LOOPS
+    )
+    runner.bench_time_func(
+        'kill greenlets with killall()',
+        bm_kill,
+        True,
+        inner_loops=KILL_INNER_LOOPS
+    )
 
     runner.bench_time_func(
         'switch between two greenlets',
@@ -101,6 +246,23 @@ if __name__ == '__main__':
         inner_loops=SWITCH_INNER_LOOPS
     )
 
+    for depth in SWITCH_DEPTHS:
+        runner.bench_time_func(
+            'switch at depth %d, shared stack' % depth,
+            bm_switch_at_depth,
+            depth,
+            0,
+            inner_loops=SWITCH_INNER_LOOPS
+        )
+        if greenlet._greenlet.GREENLET_USE_DEDICATED_STACKS:
+            runner.bench_time_func(
+                'switch at depth %d, dedicated stacks' % depth,
+                bm_switch_at_depth,
+                depth,
+                DEDICATED_STACK_SIZE,
+                inner_loops=SWITCH_INNER_LOOPS
+            )
+
     runner.bench_time_func(
         'getcurrent single thread',
         bm_getcurrent,
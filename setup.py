@@ -165,6 +165,11 @@ else:
             ] + ([
                 ('WIN32', '1'),
             ] if is_win else [
+            ]) + ([
+                # Don't keep the floating point control registers
+                # per greenlet; see platform/switch_amd64_unix.h
+                ('GREENLET_LEAN_SWITCH', '1'),
+            ] if os.environ.get('GREENLET_LEAN_SWITCH') in ('1', 'yes') else [
             ])
         ),
         # Test extensions.
@@ -15,6 +15,9 @@ __all__ = [
 
     'getcurrent',
     'greenlet',
+    'killall',
+    'stack_size',
+    'trim_stack_pool',
 
     'gettrace',
     'settrace',
@@ -39,6 +42,9 @@ from ._greenlet import error
 ###
 from ._greenlet import getcurrent
 from ._greenlet import greenlet
+from ._greenlet import killall
+from ._greenlet import stack_size
+from ._greenlet import trim_stack_pool
 
 ###
 # tracing
@@ -68,4 +74,16 @@ from ._greenlet import CLOCKS_PER_SEC # pylint:disable=unused-import
 from ._greenlet import enable_optional_cleanup # pylint:disable=unused-import
 from ._greenlet import get_clocks_used_doing_optional_cleanup # pylint:disable=unused-import
 
+# Discarding suspended greenlets without killing them. Provisional API.
+from ._greenlet import enable_abandon_on_dealloc # pylint:disable=unused-import
+
+# Tuning and inspecting how stacks are saved. Provisional API.
+from ._greenlet import enable_stack_copy_retention # pylint:disable=unused-import
+from ._greenlet import enable_stack_compression # pylint:disable=unused-import
+from ._greenlet import set_stack_memory_limit # pylint:disable=unused-import
+from ._greenlet import get_learned_stack_sizes # pylint:disable=unused-import
+from ._greenlet import compact_stacks # pylint:disable=unused-import
+from ._greenlet import set_stack_compaction_interval # pylint:disable=unused-import
+from ._greenlet import get_stack_stats # pylint:disable=unused-import
+
 # Other APIS in the _greenlet module are for test support.
@@ -15,6 +15,9 @@
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
 #include "structmember.h" // PyMemberDef
+#if PY_VERSION_HEX < 0x30B00A4
+#  include "frameobject.h" // PyFrameObject.f_valuestack
+#endif
 
 #include "greenlet_internal.hpp"
 #include "greenlet_refs.hpp"
@@ -28,6 +31,7 @@ using greenlet::Mutex;
 using greenlet::LockGuard;
 using greenlet::LockInitError;
 using greenlet::PyErrOccurred;
+using greenlet::ValueError;
 using greenlet::Require;
 using greenlet::PyFatalError;
 using greenlet::ExceptionState;
@@ -265,6 +269,44 @@ single_result(const OwnedObject& results)
     return results;
 }
 
+#if GREENLET_PY37
+/**
+ * Collect the positional arguments of a METH_FASTCALL or vectorcall
+ * call into a tuple, for the paths that still need one.
+ */
+static OwnedObject
+vectorcall_args(PyObject* const* args, const Py_ssize_t nargs)
+{
+    OwnedObject result = OwnedObject::consuming(Require(PyTuple_New(nargs)));
+    for (Py_ssize_t i = 0; i < nargs; i++) {
+        Py_INCREF(args[i]);
+        PyTuple_SET_ITEM(result.borrow(), i, args[i]);
+    }
+    return result;
+}
+
+/**
+ * Collect the keyword arguments following *nargs* positional
+ * arguments into a dict. Returns NULL (without an exception) if
+ * there are none.
+ */
+static OwnedObject
+vectorcall_kwargs(PyObject* const* args, const Py_ssize_t nargs, PyObject* kwnames)
+{
+    OwnedObject result;
+    if (!kwnames || !PyTuple_GET_SIZE(kwnames)) {
+        return result;
+    }
+    result = OwnedObject::consuming(Require(PyDict_New()));
+    for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(kwnames); i++) {
+        Require(PyDict_SetItem(result.borrow(),
+                               PyTuple_GET_ITEM(kwnames, i),
+                               args[nargs + i]));
+    }
+    return result;
+}
+#endif
+
 
 
 class ImmortalEventName : public ImmortalString
@@ -312,6 +354,9 @@ public:
     const ImmortalObject empty_tuple;
     const ImmortalObject empty_dict;
     const ImmortalString str_run;
+    // The most stack each kind of greenlet has had to save; see
+    // ``learn_stack_size``.
+    const ImmortalObject learned_stack_sizes;
     Mutex* const thread_states_to_destroy_lock;
     greenlet::cleanup_queue_t thread_states_to_destroy;
 
@@ -323,6 +368,7 @@ public:
         empty_tuple(0),
         empty_dict(0),
         str_run(0),
+        learned_stack_sizes(0),
         thread_states_to_destroy_lock(0)
     {}
 
@@ -334,6 +380,7 @@ public:
         empty_tuple(Require(PyTuple_New(0))),
         empty_dict(Require(PyDict_New())),
         str_run("run"),
+        learned_stack_sizes(Require(PyDict_New())),
         thread_states_to_destroy_lock(new Mutex())
     {}
 
@@ -376,6 +423,95 @@ static const GreenletGlobals mod_globs(0);
 // in a new thread, decremented when it is destroyed.
 static Py_ssize_t total_main_greenlets;
 
+// The stack size given to greenlets that don't ask for one; see
+// ``mod_stack_size``. 0 means to share the thread's stack.
+static size_t default_stack_size;
+// We refuse sizes that Python code could overflow before reaching
+// the recursion limit: before 3.12, nothing checks the C stack
+// itself, and running into the guard page kills the process. At the
+// default limit of 1000, recursing through a C function like
+// ``sorted(key=...)`` takes about 1.6MB on x86_64; this leaves room
+// for heavier C functions and debug builds. Pages a greenlet never
+// touches only cost address space.
+static const Py_ssize_t GREENLET_MIN_STACK_SIZE = 4 * 1024 * 1024;
+// The size of each stack group's stack if there's no default stack
+// size. Like a typical main thread stack; pages we don't touch cost
+// nothing.
+static const size_t GREENLET_STACK_GROUP_SIZE = 8 * 1024 * 1024;
+static const Py_ssize_t GREENLET_MAX_STACK_GROUPS = 64;
+// ``mod_enable_abandon_on_dealloc``. If true, every suspended
+// greenlet is abandoned when deallocated, whatever its own
+// ``abandon_on_dealloc`` says.
+static bool abandon_all_on_dealloc;
+// Greenlets running many different functions aren't going to
+// benefit from this.
+static const Py_ssize_t GREENLET_MAX_LEARNED_STACK_SIZES = 1024;
+
+// Greenlets running the same code tend to need about as much stack
+// as each other. We remember about how much has had to be saved,
+// keyed by the code object of ``run``, and allocate that much the
+// first time a new greenlet's stack is saved, instead of growing the
+// copy as more of the stack has to be saved. The estimate is a
+// moving average, capped at the largest buffer the stack pool keeps,
+// so that one unusually deep greenlet doesn't make all the later
+// ones allocate too much. ``trim_stack_pool()`` forgets it all
+// (along with our references to the code objects).
+static PyObject*
+learned_stack_size_key(PyObject* run)
+{
+    if (PyMethod_Check(run)) {
+        run = PyMethod_GET_FUNCTION(run);
+    }
+    if (PyFunction_Check(run)) {
+        return PyFunction_GET_CODE(run);
+    }
+    return nullptr;
+}
+
+static size_t
+learned_stack_size(PyObject* run)
+{
+    PyObject* key = learned_stack_size_key(run);
+    if (!key) {
+        return 0;
+    }
+    PyObject* size = PyDict_GetItem(mod_globs.learned_stack_sizes.borrow(), key);
+    return size ? PyLong_AsSize_t(size) : 0;
+}
+
+static void
+learn_stack_size(PyObject* run, const intptr_t size)
+{
+    PyObject* key = learned_stack_size_key(run);
+    if (!key || size <= 0) {
+        return;
+    }
+    const Py_ssize_t capped = std::min(static_cast<Py_ssize_t>(size),
+                                       static_cast<Py_ssize_t>(StackCopyPool::max_pooled_capacity()));
+    PyObject* sizes = mod_globs.learned_stack_sizes.borrow();
+    PyObject* old = PyDict_GetItem(sizes, key);
+    Py_ssize_t learned = capped;
+    if (old) {
+        // Move a quarter of the way to the new size.
+        const Py_ssize_t previous = PyLong_AsSsize_t(old);
+        learned = previous + (capped - previous) / 4;
+        if (learned == previous) {
+            return;
+        }
+    }
+    else if (PyDict_Size(sizes) >= GREENLET_MAX_LEARNED_STACK_SIZES) {
+        return;
+    }
+    // We may be finishing with an exception.
+    PyErrPieces saved;
+    PyObject* value = PyLong_FromSsize_t(learned);
+    if (!value || PyDict_SetItem(sizes, key, value) < 0) {
+        PyErr_Clear();
+    }
+    Py_XDECREF(value);
+    saved.PyErrRestore();
+}
+
 struct ThreadState_DestroyWithGIL
 {
     ThreadState_DestroyWithGIL(ThreadState* state)
@@ -759,12 +895,23 @@ static ThreadStateCreator& GET_THREAD_STATE()
 
 
 Greenlet::Greenlet(PyGreenlet* p)
+    : _main_kind(false),
+      _abandon_on_dealloc(false),
+      _next_pending_delete(nullptr),
+      _held_by_frame(nullptr)
 {
+    // Along with the first cache line of the stack state, the
+    // members a switch uses should take at most three cache lines.
+    G_LAYOUT_ASSERT(offsetof(Greenlet, stack_state) <= 128,
+                    "Greenlet members used on each switch are spread out");
     p ->pimpl = this;
 }
 
 Greenlet::Greenlet(PyGreenlet* p, const StackState& initial_stack)
-    : stack_state(initial_stack)
+    : _main_kind(true), _abandon_on_dealloc(false),
+      stack_state(initial_stack),
+      _next_pending_delete(nullptr),
+      _held_by_frame(nullptr)
 {
     // can't use a delegating constructor because of
     // MSVC for Python 2.7
@@ -772,9 +919,13 @@ Greenlet::Greenlet(PyGreenlet* p, const StackState& initial_stack)
 }
 
 UserGreenlet::UserGreenlet(PyGreenlet* p,BorrowedGreenlet the_parent)
-    : Greenlet(p), _parent(the_parent)
+    : Greenlet(p), _parent(the_parent), _stack_size(default_stack_size),
+      _stack_group(-1)
 {
     this->_self = p;
+    if (the_parent) {
+        this->_main_greenlet_of_parent = the_parent->main_greenlet().borrow();
+    }
 }
 
 
@@ -823,18 +974,84 @@ MainGreenlet::main_greenlet() const
     return this->_self;
 }
 
+/**
+ * Greenlets of exactly the greenlet type (which includes all main
+ * greenlets) keep their C++ object in the same block of memory as
+ * the PyGreenlet, right after it, instead of in a second allocation.
+ * ``pimpl`` still points to it, so the layout of PyGreenlet, the C
+ * API, and C subclasses are unchanged. Instances of subclasses may
+ * be bigger than a PyGreenlet, so they allocate it separately.
+ *
+ * To get one block from the garbage collector, we allocate it as an
+ * instance of this private variable-sized type, and then make that a
+ * greenlet. It is never readied or exposed.
+ */
+// Rounded up so the C++ object is suitably aligned.
+static const size_t GREENLET_INLINE_IMPL_OFFSET = (sizeof(PyGreenlet) + 15) & ~(size_t)15;
+static const size_t GREENLET_INLINE_IMPL_SIZE = sizeof(UserGreenlet) > sizeof(MainGreenlet)
+    ? sizeof(UserGreenlet) : sizeof(MainGreenlet);
+
+static PyTypeObject PyGreenletStorage_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "greenlet._greenlet._GreenletStorage",
+    GREENLET_INLINE_IMPL_OFFSET,        /* tp_basicsize */
+    1,                                  /* tp_itemsize */
+    0,                                  /* tp_dealloc */
+    0,                                  /* tp_print */
+    0,                                  /* tp_getattr */
+    0,                                  /* tp_setattr */
+    0,                                  /* tp_compare */
+    0,                                  /* tp_repr */
+    0,                                  /* tp_as _number*/
+    0,                                  /* tp_as _sequence*/
+    0,                                  /* tp_as _mapping*/
+    0,                                  /* tp_hash */
+    0,                                  /* tp_call */
+    0,                                  /* tp_str */
+    0,                                  /* tp_getattro */
+    0,                                  /* tp_setattro */
+    0,                                  /* tp_as_buffer*/
+    G_TPFLAGS_DEFAULT,                  /* tp_flags */
+};
+
+static inline void*
+green_inline_impl(PyGreenlet* self)
+{
+    return reinterpret_cast<char*>(self) + GREENLET_INLINE_IMPL_OFFSET;
+}
+
+/**
+ * Allocate a greenlet object with room for its C++ object, which the
+ * caller must construct at green_inline_impl(). Like
+ * PyType_GenericAlloc, the object is zeroed and tracked.
+ */
+static PyGreenlet*
+green_alloc_with_impl()
+{
+    PyObject* o = PyType_GenericAlloc(&PyGreenletStorage_Type, GREENLET_INLINE_IMPL_SIZE);
+    if (!o) {
+        return nullptr;
+    }
+    PyGreenlet* self = reinterpret_cast<PyGreenlet*>(o);
+    // Initializing a variable-sized object stored its size where a
+    // greenlet keeps its weakreflist.
+    self->weakreflist = nullptr;
+    Py_SET_TYPE(o, &PyGreenlet_Type);
+    return self;
+}
+
 static PyGreenlet*
 green_create_main(ThreadState* state)
 {
     PyGreenlet* gmain;
 
     /* create the main greenlet for this thread */
-    gmain = (PyGreenlet*)PyType_GenericAlloc(&PyGreenlet_Type, 0);
+    gmain = green_alloc_with_impl();
     if (gmain == NULL) {
         Py_FatalError("green_create_main failed to alloc");
         return NULL;
     }
-    new MainGreenlet(gmain, state);
+    ::new(green_inline_impl(gmain)) MainGreenlet(gmain, state);
 
     assert(Py_REFCNT(gmain) == 1);
     return gmain;
@@ -849,6 +1066,10 @@ UserGreenlet::find_main_greenlet_in_lineage() const
         return BorrowedMainGreenlet(this->_main_greenlet);
     }
 
+    if (this->_main_greenlet_of_parent) {
+        return BorrowedMainGreenlet(this->_main_greenlet_of_parent);
+    }
+
     if (!this->_parent) {
         /* garbage collected greenlet in chain */
         // XXX: WHAT?
@@ -876,8 +1097,8 @@ MainGreenlet::find_main_greenlet_in_lineage() const
    * g_initialstub, when inlined would receive a pointer into its
      own stack frame, leading to incomplete stack save/restore
 
-g_initialstub is a member function and declared virtual so that the
-compiler always calls it through a vtable.
+g_initialstub is a member function declared with GREENLET_NOINLINE,
+as is g_switchstack_success, which runs on the far side of a switch.
 
 slp_save_state and slp_restore_state are also member functions. They
 are called from trampoline functions that themselves are declared as
@@ -908,10 +1129,10 @@ g_handle_exit(const OwnedObject& greenlet_result);
  * Figure out what the result of ``greenlet.switch(arg, kwargs)``
  * should be and transfers ownership of it to the left-hand-side.
  *
- * If switch() was just passed an arg tuple, then we'll just return that.
- * If only keyword arguments were passed, then we'll pass the keyword
- * argument dict. Otherwise, we'll create a tuple of (args, kwargs) and
- * return both.
+ * If switch() was just passed an arg tuple, then we'll just return that
+ * (or its only item, if it has only one). If only keyword arguments
+ * were passed, then we'll pass the keyword argument dict. Otherwise,
+ * we'll create a tuple of (args, kwargs) and return both.
  */
 OwnedObject& operator<<=(OwnedObject& lhs, greenlet::SwitchingArgs& rhs) G_NOEXCEPT
 {
@@ -919,21 +1140,25 @@ OwnedObject& operator<<=(OwnedObject& lhs, greenlet::SwitchingArgs& rhs) G_NOEXC
     // result in switching back to us, we need to get the
     // arguments locally on the stack.
     assert(rhs);
-    OwnedObject args = rhs.args();
-    OwnedObject kwargs = rhs.kwargs();
+    const bool single = rhs.single();
+    OwnedObject args = G_MOVE(rhs.args());
+    OwnedObject kwargs = G_MOVE(rhs.kwargs());
     rhs.CLEAR();
     // We shouldn't be called twice for the same switch.
     assert(args || kwargs);
     assert(!rhs);
 
-    if (!kwargs) {
-        lhs = args;
+    if (single) {
+        lhs = G_MOVE(args);
+    }
+    else if (!kwargs) {
+        lhs = single_result(args);
     }
     else if (!PyDict_Size(kwargs.borrow())) {
-        lhs = args;
+        lhs = single_result(args);
     }
     else if (!PySequence_Length(args.borrow())) {
-        lhs = kwargs;
+        lhs = G_MOVE(kwargs);
     }
     else {
         lhs = OwnedObject::consuming(PyTuple_Pack(2, args.borrow(), kwargs.borrow()));
@@ -961,21 +1186,9 @@ void UserGreenlet::operator delete(void* ptr)
                                 1);
 }
 
-void* MainGreenlet::operator new(size_t UNUSED(count))
-{
-    return allocator.allocate(1);
-}
-
-
-void MainGreenlet::operator delete(void* ptr)
-{
-    return allocator.deallocate(static_cast<MainGreenlet*>(ptr),
-                                1);
-}
-
 
 OwnedObject
-Greenlet::throw_GreenletExit_during_dealloc(const ThreadState& UNUSED(current_thread_state))
+Greenlet::_throw_GreenletExit_during_dealloc(const ThreadState& UNUSED(current_thread_state))
 {
     // If we're killed because we lost all references in the
     // middle of a switch, that's ok. Don't reset the args/kwargs,
@@ -983,7 +1196,7 @@ Greenlet::throw_GreenletExit_during_dealloc(const ThreadState& UNUSED(current_th
     PyErr_SetString(mod_globs.PyExc_GreenletExit,
                     "Killing the greenlet because all references have vanished.");
     // To get here it had to have run before
-    return this->g_switch();
+    return this->g_switch(*this->thread_state());
 }
 
 OwnedObject
@@ -998,7 +1211,7 @@ UserGreenlet::throw_GreenletExit_during_dealloc(const ThreadState& current_threa
     // exception happened. Whether or not an exception happens,
     // we need to restore the parent in case the greenlet gets
     // resurrected.
-    return Greenlet::throw_GreenletExit_during_dealloc(current_thread_state);
+    return this->_throw_GreenletExit_during_dealloc(current_thread_state);
 }
 
 ThreadState*
@@ -1034,9 +1247,19 @@ Greenlet::slp_restore_state() G_NOEXCEPT
 #ifdef SLP_BEFORE_RESTORE_STATE
     SLP_BEFORE_RESTORE_STATE();
 #endif
-    this->stack_state.copy_heap_to_stack(
-           this->thread_state()->borrow_current()->stack_state);
+    this->stack_state.copy_heap_to_stack(this->thread_state()->stack_copy_pool());
+}
+
+#if GREENLET_USE_DEDICATED_STACKS
+extern "C" {
+static void
+slp_start_on_stack_trampoline(void* context)
+{
+    // Only user greenlets are ever started.
+    static_cast<UserGreenlet*>(static_cast<Greenlet*>(context))->bootstrap_on_own_stack();
+}
 }
+#endif
 
 
 inline int
@@ -1049,16 +1272,33 @@ Greenlet::slp_save_state(char *const stackref) G_NOEXCEPT
 #ifdef SLP_BEFORE_SAVE_STATE
     SLP_BEFORE_SAVE_STATE();
 #endif
-    return this->stack_state.copy_stack_to_heap(stackref,
-                                                this->thread_state()->borrow_current()->stack_state);
+    ThreadState* const thread_state = this->thread_state();
+    if (this->stack_state.copy_stack_to_heap(stackref,
+                                             thread_state->borrow_current()->stack_state,
+                                             thread_state->stack_copy_pool())) {
+        return -1;
+    }
+#if GREENLET_USE_DEDICATED_STACKS
+    if (!this->stack_state.active() && this->stack_state.owns_region()) {
+        // Starting a greenlet on its own stack. Rather than returning to
+        // slp_switch() and continuing on this stack, the new greenlet
+        // begins at the top of its region. The frames we leave behind are
+        // intact, and when someone switches back to them slp_switch()
+        // returns 0 as usual.
+        slp_start_on_stack(this->stack_state.region_top(),
+                           slp_start_on_stack_trampoline,
+                           this);
+    }
+#endif
+    return 0;
 }
 
 
 OwnedObject
-UserGreenlet::g_switch()
+UserGreenlet::g_switch(ThreadState& current_thread_state)
 {
     try {
-        this->check_switch_allowed();
+        this->check_switch_allowed(current_thread_state);
     }
     catch(const PyErrOccurred&) {
         this->release_args();
@@ -1090,7 +1330,7 @@ UserGreenlet::g_switch()
                 target->args() <<= this->switch_args;
                 assert(!this->switch_args);
             }
-            err = target->g_switchstack();
+            err = target->g_switchstack(current_thread_state);
             break;
         }
         if (!target->started()) {
@@ -1109,7 +1349,7 @@ UserGreenlet::g_switch()
                 // This can only throw back to us while we're
                 // still in this greenlet. Once the new greenlet
                 // is bootstrapped, it has its own exception state.
-                err = real_target->g_initialstub(&dummymarker);
+                err = real_target->g_initialstub(&dummymarker, current_thread_state);
             }
             catch (const PyErrOccurred&) {
                 this->release_args();
@@ -1148,17 +1388,17 @@ UserGreenlet::g_switch()
 }
 
 OwnedObject
-MainGreenlet::g_switch()
+MainGreenlet::g_switch(ThreadState& current_thread_state)
 {
     try {
-        this->check_switch_allowed();
+        this->check_switch_allowed(current_thread_state);
     }
     catch(const PyErrOccurred&) {
         this->release_args();
         throw;
     }
 
-    switchstack_result_t err = this->g_switchstack();
+    switchstack_result_t err = this->g_switchstack(current_thread_state);
     if (err.status < 0) {
         // XXX: This code path is untested.
         assert(PyErr_Occurred());
@@ -1184,14 +1424,22 @@ Greenlet::g_switchstack_success() G_NOEXCEPT
     OwnedGreenlet result(thread_state->get_current());
     thread_state->set_current(this->self());
     //assert(thread_state->borrow_current().borrow() == this->_self);
+    if (!result->stack_state.active()) {
+        // It just finished. We're not running on its stack anymore,
+        // so if that was a dedicated stack, it can go away now.
+        result->stack_state.release_region();
+    }
+    thread_state->stack_copy_pool().did_switch();
     return result;
 }
 
 
 Greenlet::switchstack_result_t
-UserGreenlet::g_initialstub(void* mark)
+UserGreenlet::g_initialstub(void* mark, ThreadState& thread_state)
 {
     OwnedObject run;
+    StackRegion* region = nullptr;
+    size_t copy_hint = 0;
 
     // We need to grab a reference to the current switch arguments
     // in case we're entered concurrently during the call to
@@ -1215,7 +1463,7 @@ UserGreenlet::g_initialstub(void* mark)
 
 
         /* recheck that it's safe to switch in case greenlet reparented anywhere above */
-        this->check_switch_allowed();
+        this->check_switch_allowed(thread_state);
 
         /* by the time we got here another start could happen elsewhere,
          * that means it should now be a regular switch.
@@ -1232,6 +1480,30 @@ UserGreenlet::g_initialstub(void* mark)
 
             throw GreenletStartedWhileInPython();
         }
+
+        copy_hint = learned_stack_size(run.borrow());
+
+        if (this->_stack_group >= 0 || this->_stack_size) {
+            try {
+                if (this->_stack_group >= 0) {
+                    region = &thread_state.stack_group(
+                        this->_stack_group,
+                        default_stack_size ? default_stack_size : GREENLET_STACK_GROUP_SIZE);
+                    region->incref();
+                }
+                else {
+                    region = StackRegion::allocate(this->_stack_size);
+                }
+            }
+            catch (const PyErrOccurred&) {
+                this->release_args();
+                throw;
+            }
+            // Our frame won't be on the new stack, so the new
+            // greenlet can't steal ``run`` from it. Hand it over
+            // through the greenlet instead.
+            this->_run_callable = run;
+        }
     }
 
     // Sweet, if we got here, we have the go-ahead and will switch
@@ -1253,15 +1525,23 @@ UserGreenlet::g_initialstub(void* mark)
     this->python_state.set_new_cframe(trace_info);
 #endif
     /* start the greenlet */
-    ThreadState& thread_state = GET_THREAD_STATE().state();
-    this->stack_state = StackState(mark,
-                                   thread_state.borrow_current()->stack_state);
-    this->python_state.set_initial_state(PyThreadState_GET());
+    if (region) {
+        this->stack_state = StackState(*region);
+        // The state holds the reference now.
+        region->decref();
+    }
+    else {
+        this->stack_state = StackState(mark,
+                                       thread_state.borrow_current()->stack_state);
+    }
+    this->stack_state.set_stack_copy_hint(copy_hint);
+    this->python_state.set_initial_state(PyThreadState_GET(),
+                                         thread_state.frame_chunk_cache());
     this->exception_state.clear();
     this->_main_greenlet = thread_state.get_main_greenlet();
 
     /* perform the initial switch */
-    switchstack_result_t err = this->g_switchstack();
+    switchstack_result_t err = this->g_switchstack(thread_state);
     /* returns twice!
        The 1st time with ``err == 1``: we are in the new greenlet.
        This one owns a greenlet that used to be current.
@@ -1279,8 +1559,10 @@ UserGreenlet::g_initialstub(void* mark)
         this->inner_bootstrap(err.origin_greenlet, run);
         Py_FatalError("greenlet: inner_bootstrap returned\n");
     }
-    // The child will take care of decrefing this.
-    run.relinquish_ownership();
+    if (!region) {
+        // The child will take care of decrefing this.
+        run.relinquish_ownership();
+    }
 
     // In contrast, notice that we're keeping the origin greenlet
     // around as an owned reference; we need it to call the trace
@@ -1301,6 +1583,23 @@ UserGreenlet::g_initialstub(void* mark)
 }
 
 
+void
+UserGreenlet::bootstrap_on_own_stack() G_NOEXCEPT_WIN32
+{
+#if GREENLET_USE_CFRAME
+    // The frame that g_initialstub() set up is on the stack we just
+    // left, which may be reused as soon as the parent runs again.
+    _PyCFrame trace_info;
+    this->python_state.set_new_cframe(trace_info);
+#endif
+    // This is what g_switchstack() would have done had slp_switch()
+    // returned.
+    OwnedGreenlet origin_greenlet(this->g_switchstack_success());
+    OwnedObject run(this->_run_callable);
+    this->inner_bootstrap(origin_greenlet, run);
+    Py_FatalError("greenlet: inner_bootstrap returned\n");
+}
+
 void
 UserGreenlet::inner_bootstrap(OwnedGreenlet& origin_greenlet, OwnedObject& _run) G_NOEXCEPT_WIN32
 {
@@ -1376,7 +1675,13 @@ UserGreenlet::inner_bootstrap(OwnedGreenlet& origin_greenlet, OwnedObject& _run)
         // This could result in further switches
         try {
             //result = run.PyCall(args.args(), args.kwargs());
-            result = OwnedObject::consuming(PyObject_Call(run, args.args().borrow(), args.kwargs().borrow()));
+            if (args.single()) {
+                result = OwnedObject::consuming(
+                    PyObject_CallFunctionObjArgs(run, args.args().borrow(), NULL));
+            }
+            else {
+                result = OwnedObject::consuming(PyObject_Call(run, args.args().borrow(), args.kwargs().borrow()));
+            }
         }
         catch(...) {
             // Unhandled C++ exception!
@@ -1425,6 +1730,7 @@ UserGreenlet::inner_bootstrap(OwnedGreenlet& origin_greenlet, OwnedObject& _run)
         }
     }
     args.CLEAR();
+    learn_stack_size(run, this->stack_state.stack_saved_max());
     Py_CLEAR(run);
 
     if (!result
@@ -1435,10 +1741,10 @@ UserGreenlet::inner_bootstrap(OwnedGreenlet& origin_greenlet, OwnedObject& _run)
         // See test_dealloc_switch_args_not_lost
         PyErrPieces clear_error;
         result <<= this->switch_args;
-        result = single_result(result);
     }
     this->release_args();
-    this->python_state.did_finish(PyThreadState_GET());
+    this->python_state.did_finish(PyThreadState_GET(),
+                                  &this->thread_state()->frame_chunk_cache());
 
     result = g_handle_exit(result);
     assert(this->thread_state()->borrow_current() == this->_self);
@@ -1464,7 +1770,7 @@ UserGreenlet::inner_bootstrap(OwnedGreenlet& origin_greenlet, OwnedObject& _run)
         // typical case we'll never get back here to assign to
         // result and thus release the reference.
         try {
-            result = parent->g_switch();
+            result = parent->g_switch(*this->thread_state());
         }
         catch (const PyErrOccurred&) {
             // Ignore.
@@ -1485,35 +1791,54 @@ UserGreenlet::inner_bootstrap(OwnedGreenlet& origin_greenlet, OwnedObject& _run)
 
 
 Greenlet::switchstack_result_t
-Greenlet::g_switchstack(void)
+Greenlet::g_switchstack(ThreadState& thread_state)
 {
+    // We've been checked to be switchable from this thread, so
+    // *thread_state* is ours too.
+    assert(this->thread_state() == &thread_state);
     { /* save state */
-        if (this->thread_state()->is_current(this->self())) {
+        if (thread_state.is_current(this->self())) {
             // Hmm, nothing to do.
             // TODO: Does this bypass trace events that are
             // important?
             return switchstack_result_t(0,
-                                        this, this->thread_state()->borrow_current());
+                                        this, thread_state.borrow_current());
         }
-        BorrowedGreenlet current = this->thread_state()->borrow_current();
+        BorrowedGreenlet current = thread_state.borrow_current();
         PyThreadState* tstate = PyThreadState_GET();
         current->python_state << tstate;
         current->exception_state << tstate;
         this->python_state.will_switch_from(tstate);
+#if !GREENLET_SWITCH_CONTEXT
         switching_thread_state = this;
+#endif
     }
+#if GREENLET_SWITCH_CONTEXT
+    // If this is the first switch into a greenlet, this will
+    // return twice, once with SLP_SWITCH_STARTED in the new greenlet,
+    // once with the greenlet that switched back in the origin.
+    void* const switched_to = slp_switch(this);
+    const int err = switched_to == SLP_SWITCH_FAILED
+        ? -1
+        : (switched_to == SLP_SWITCH_STARTED ? 1 : 0);
+#else
     // If this is the first switch into a greenlet, this will
     // return twice, once with 1 in the new greenlet, once with 0
     // in the origin.
     int err = slp_switch();
+#endif
 
     if (err < 0) { /* error */
         // XXX: This code path is not tested.
-        BorrowedGreenlet current(GET_THREAD_STATE().state().borrow_current());
+        // We never left, so our stack, and *thread_state*, are
+        // still good.
+        BorrowedGreenlet current(thread_state.borrow_current());
         //current->top_frame = NULL; // This probably leaks?
         current->exception_state.clear();
 
+#if !GREENLET_SWITCH_CONTEXT
         switching_thread_state = nullptr;
+#endif
         //GET_THREAD_STATE().state().wref_target(NULL);
         this->release_args();
         // It's important to make sure not to actually return an
@@ -1526,23 +1851,28 @@ Greenlet::g_switchstack(void)
 
     // No stack-based variables are valid anymore.
 
+#if GREENLET_SWITCH_CONTEXT
+    // Unless we just started, in which case we haven't gone
+    // anywhere and ``this`` is still right, it's the greenlet
+    // slp_switch() handed back that we're now running.
+    Greenlet* after_switch = err
+        ? this
+        : static_cast<Greenlet*>(switched_to);
+    OwnedGreenlet origin = after_switch->g_switchstack_success();
+#else
     // But the global is volatile so we can reload it without the
     // compiler caching it from earlier.
     Greenlet* after_switch = switching_thread_state;
     OwnedGreenlet origin = after_switch->g_switchstack_success();
     switching_thread_state = nullptr;
+#endif
     return switchstack_result_t(err, after_switch, origin);
 }
 
 
 inline void
-Greenlet::check_switch_allowed() const
+Greenlet::check_switch_allowed(const ThreadState& current_thread_state) const
 {
-    // TODO: Make this take a parameter of the current greenlet,
-    // or current main greenlet, to make the check for
-    // cross-thread switching cheaper. Surely somewhere up the
-    // call stack we've already accessed the thread local variable.
-
     // We expect to always have a main greenlet now; accessing the thread state
     // created it. However, if we get here and cleanup has already
     // begun because we're a greenlet that was running in a
@@ -1556,6 +1886,21 @@ Greenlet::check_switch_allowed() const
     // to a dead thread.
 
     const BorrowedMainGreenlet main_greenlet = this->find_main_greenlet_in_lineage();
+    // The main greenlet we found was from the .parent lineage.
+    // That may or may not have any relationship to the main
+    // greenlet of the running thread. We can't actually access
+    // our this->thread_state members to try to check that,
+    // because it could be in the process of getting destroyed,
+    // but setting the main_greenlet->thread_state member to NULL
+    // may not be visible yet. So we check against the
+    // current thread state, which our caller already has.
+    const BorrowedMainGreenlet current_main_greenlet = current_thread_state.borrow_main_greenlet();
+
+    if (main_greenlet == current_main_greenlet && main_greenlet
+        && main_greenlet->thread_state()) {
+        // The common case: switching within this (live) thread.
+        return;
+    }
 
     if (!main_greenlet) {
         throw PyErrOccurred(mod_globs.PyExc_GreenletError,
@@ -1567,32 +1912,12 @@ Greenlet::check_switch_allowed() const
                             "cannot switch to a different thread (which happens to have exited)");
     }
 
-    // The main greenlet we found was from the .parent lineage.
-    // That may or may not have any relationship to the main
-    // greenlet of the running thread. We can't actually access
-    // our this->thread_state members to try to check that,
-    // because it could be in the process of getting destroyed,
-    // but setting the main_greenlet->thread_state member to NULL
-    // may not be visible yet. So we need to check against the
-    // current thread state (once the cheaper checks are out of
-    // the way)
-    const BorrowedMainGreenlet current_main_greenlet = GET_THREAD_STATE().state().borrow_main_greenlet();
-    if (
-        // lineage main greenlet is not this thread's greenlet
-        current_main_greenlet != main_greenlet
-        || (
-            // atteched to some thread
-            this->main_greenlet()
-            // XXX: Same condition as above. Was this supposed to be
-            // this->main_greenlet()?
-            && current_main_greenlet != main_greenlet)
-        // switching into a known dead thread (XXX: which, if we get here,
-        // is bad, because we just accessed the thread state, which is
-        // gone!)
-        || (!current_main_greenlet->thread_state())) {
-        throw PyErrOccurred(mod_globs.PyExc_GreenletError,
-                            "cannot switch to a different thread");
-    }
+    // Either the lineage main greenlet is not this thread's
+    // greenlet, or we're switching into a known dead thread
+    // (XXX: which, if we get here, is bad, because our caller just
+    // accessed the thread state, which is gone!)
+    throw PyErrOccurred(mod_globs.PyExc_GreenletError,
+                        "cannot switch to a different thread");
 }
 
 
@@ -1640,10 +1965,18 @@ Greenlet::g_switch_finish(const switchstack_result_t& err)
 
 
 greenlet::PythonAllocator<UserGreenlet> UserGreenlet::allocator;
-greenlet::PythonAllocator<MainGreenlet> MainGreenlet::allocator;
 
 
 extern "C" {
+static int GREENLET_NOINLINE(slp_save_state_context_trampoline)(void* context, char* stackref)
+{
+    return static_cast<Greenlet*>(context)->slp_save_state(stackref);
+}
+static void* GREENLET_NOINLINE(slp_restore_state_context_trampoline)(void* context)
+{
+    static_cast<Greenlet*>(context)->slp_restore_state();
+    return context;
+}
 static int GREENLET_NOINLINE(slp_save_state_trampoline)(char* stackref)
 {
     return switching_thread_state->slp_save_state(stackref);
@@ -1758,10 +2091,28 @@ g_handle_exit(const OwnedObject& greenlet_result)
 static PyGreenlet*
 green_new(PyTypeObject* type, PyObject* UNUSED(args), PyObject* UNUSED(kwds))
 {
-    PyGreenlet* o =
-        (PyGreenlet*)PyBaseObject_Type.tp_new(type, mod_globs.empty_tuple, mod_globs.empty_dict);
+    ThreadState& state = GET_THREAD_STATE().state();
+    PyGreenlet* o;
+    if (type == &PyGreenlet_Type) {
+        o = state.reuse_dead_greenlet();
+        if (o) {
+            // Like a fresh allocation from green_alloc_with_impl().
+            PyObject_Init(reinterpret_cast<PyObject*>(o), type);
+            o->weakreflist = nullptr;
+            o->dict = nullptr;
+            ::new(green_inline_impl(o)) UserGreenlet(o, state.borrow_current());
+            PyObject_GC_Track(o);
+            return o;
+        }
+        o = green_alloc_with_impl();
+        if (o) {
+            ::new(green_inline_impl(o)) UserGreenlet(o, state.borrow_current());
+        }
+        return o;
+    }
+    o = (PyGreenlet*)PyBaseObject_Type.tp_new(type, mod_globs.empty_tuple, mod_globs.empty_dict);
     if (o) {
-        new UserGreenlet(o, GET_THREAD_STATE().state().borrow_current());
+        new UserGreenlet(o, state.borrow_current());
         assert(Py_REFCNT(o) == 1);
     }
     return o;
@@ -1772,20 +2123,94 @@ green_setrun(BorrowedGreenlet self, BorrowedObject nrun, void* c);
 static int
 green_setparent(BorrowedGreenlet self, BorrowedObject nparent, void* c);
 
+/**
+ * Validate a stack size given from Python: 0, or something that can
+ * reasonably hold Python frames. Throws if not acceptable.
+ */
+static size_t
+green_check_stack_size(const Py_ssize_t size)
+{
+    if (size < 0 || (size && size < GREENLET_MIN_STACK_SIZE)) {
+        PyErr_Format(PyExc_ValueError, "size not valid: %zd bytes", size);
+        throw PyErrOccurred();
+    }
+#if !GREENLET_USE_DEDICATED_STACKS
+    if (size) {
+        throw PyErrOccurred(mod_globs.PyExc_GreenletError,
+                            "Dedicated greenlet stacks are not supported on this platform");
+    }
+#endif
+    return (size_t)size;
+}
+
+static int
+green_setstacksize(BorrowedGreenlet self, BorrowedObject nsize)
+{
+    try {
+        if (self->main()) {
+            throw ValueError("cannot set the stack size of a main greenlet");
+        }
+        Py_ssize_t size = PyNumber_AsSsize_t(nsize, PyExc_OverflowError);
+        if (size == -1 && PyErr_Occurred()) {
+            throw PyErrOccurred();
+        }
+        static_cast<UserGreenlet*>(self.borrow()->pimpl)->stack_size(green_check_stack_size(size));
+        return 0;
+    }
+    catch (const PyErrOccurred&) {
+        return -1;
+    }
+}
+
+static int
+green_setstackgroup(BorrowedGreenlet self, BorrowedObject ngroup)
+{
+    try {
+        if (self->main()) {
+            throw ValueError("cannot set the stack group of a main greenlet");
+        }
+        Py_ssize_t group = PyNumber_AsSsize_t(ngroup, PyExc_OverflowError);
+        if (group == -1 && PyErr_Occurred()) {
+            throw PyErrOccurred();
+        }
+        if (group < 0 || group >= GREENLET_MAX_STACK_GROUPS) {
+            PyErr_Format(PyExc_ValueError,
+                         "stack group must be between 0 and %zd",
+                         GREENLET_MAX_STACK_GROUPS - 1);
+            throw PyErrOccurred();
+        }
+#if GREENLET_USE_DEDICATED_STACKS
+        static_cast<UserGreenlet*>(self.borrow()->pimpl)->stack_group(group);
+        return 0;
+#else
+        throw PyErrOccurred(mod_globs.PyExc_GreenletError,
+                            "Greenlet stack groups are not supported on this platform");
+#endif
+    }
+    catch (const PyErrOccurred&) {
+        return -1;
+    }
+}
+
 static int
 green_init(BorrowedGreenlet self, BorrowedObject args, BorrowedObject kwargs)
 {
     PyArgParseParam run;
     PyArgParseParam nparent;
+    PyArgParseParam nstack_size;
+    PyArgParseParam nstack_group;
     static const char* const kwlist[] = {
         "run",
         "parent",
+        "stack_size",
+        "stack_group",
         NULL
     };
 
     // recall: The O specifier does NOT increase the reference count.
     if (!PyArg_ParseTupleAndKeywords(
-             args, kwargs, "|OO:green", (char**)kwlist, &run, &nparent)) {
+             args, kwargs, "|OOOO:green", (char**)kwlist,
+             &run, &nparent, &nstack_size, &nstack_group)) {
         return -1;
     }
 
@@ -1794,12 +2219,67 @@ green_init(BorrowedGreenlet self, BorrowedObject args, BorrowedObject kwargs)
             return -1;
         }
     }
+    if (nstack_size && !nstack_size.is_None()) {
+        if (green_setstacksize(self, nstack_size)) {
+            return -1;
+        }
+    }
+    if (nstack_group && !nstack_group.is_None()) {
+        if (green_setstackgroup(self, nstack_group)) {
+            return -1;
+        }
+    }
     if (nparent && !nparent.is_None()) {
         return green_setparent(self, nparent, NULL);
     }
     return 0;
 }
 
+#if GREENLET_USE_TYPE_VECTORCALL
+/**
+ * Called for ``greenlet(...)`` instead of tp_new and tp_init, without
+ * argument tuples. The common forms, ``greenlet(run)`` and
+ * ``greenlet(run, parent)``, don't need any argument parsing.
+ */
+static PyObject*
+green_vectorcall(PyObject* type, PyObject* const* args, size_t nargsf, PyObject* kwnames)
+{
+    // This isn't inherited, but make sure we don't skip the
+    // __new__ or __init__ of a subclass.
+    assert(type == reinterpret_cast<PyObject*>(&PyGreenlet_Type));
+    (void)type;
+    const Py_ssize_t nargs = PyVectorcall_NARGS(nargsf);
+    OwnedGreenlet self(OwnedGreenlet::consuming(green_new(&PyGreenlet_Type, nullptr, nullptr)));
+    if (!self) {
+        return nullptr;
+    }
+
+    if (nargs <= 2 && (!kwnames || !PyTuple_GET_SIZE(kwnames))) {
+        if (nargs > 0 && green_setrun(self, BorrowedObject(args[0]), NULL)) {
+            return nullptr;
+        }
+        if (nargs > 1
+            && args[1] != Py_None
+            && green_setparent(self, BorrowedObject(args[1]), NULL)) {
+            return nullptr;
+        }
+        return self.relinquish_ownership_o();
+    }
+
+    try {
+        if (green_init(self,
+                       vectorcall_args(args, nargs),
+                       vectorcall_kwargs(args, nargs, kwnames))) {
+            return nullptr;
+        }
+    }
+    catch (const PyErrOccurred&) {
+        return nullptr;
+    }
+    return self.relinquish_ownership_o();
+}
+#endif
+
 
 UserGreenlet::ParentIsCurrentGuard::ParentIsCurrentGuard(UserGreenlet* p,
                                                      const ThreadState& thread_state)
@@ -1817,7 +2297,7 @@ UserGreenlet::ParentIsCurrentGuard::~ParentIsCurrentGuard()
 
 
 void
-Greenlet::murder_in_place()
+Greenlet::_murder_in_place()
 {
     if (this->active()) {
         assert(!this->is_currently_running_in_some_thread());
@@ -1829,7 +2309,20 @@ void
 UserGreenlet::murder_in_place()
 {
     this->_main_greenlet.CLEAR();
-    Greenlet::murder_in_place();
+    this->_main_greenlet_of_parent.CLEAR();
+    this->_murder_in_place();
+}
+
+void
+Greenlet::abandon(const ThreadState& current_thread_state)
+{
+    assert(!this->is_currently_running_in_some_thread());
+    // Greenlets that were started after us may be using the stack
+    // just below ours; they mustn't try to save what's there on our
+    // behalf.
+    this->stack_state.leave_region_chain(
+        current_thread_state.get_current()->stack_state);
+    this->deactivate_and_free();
 }
 
 inline void
@@ -1838,6 +2331,21 @@ Greenlet::deactivate_and_free()
     if (!this->active()) {
         return;
     }
+    // The frame that was switching into the main greenlet will never
+    // get back to releasing its reference to the main greenlet (or
+    // to the bound method it called), so we do. This depends on
+    // caller_frame_reference() having found that reference on the
+    // frame's value stack, which is where CPython 3.7 through 3.11
+    // keep the callable and ``self`` of a call while it runs, just
+    // below the arguments; the assumption is checked at compile time
+    // with GREENLET_CHECK_CALLER_STACK.
+    if (this->_held_by_frame) {
+        PyObject* const held = this->_held_by_frame;
+        this->_held_by_frame = nullptr;
+        if (ThreadState::clocks_used_doing_gc() != std::clock_t(-1)) {
+            Py_DECREF(held);
+        }
+    }
     // Throw away any saved stack.
     this->stack_state = StackState();
     assert(!this->stack_state.active());
@@ -1856,7 +2364,7 @@ Greenlet::deactivate_and_free()
 }
 
 bool
-Greenlet::belongs_to_thread(const ThreadState* thread_state) const
+Greenlet::_belongs_to_thread(const ThreadState* thread_state) const
 {
     if (!this->thread_state() // not running anywhere, or thread
                               // exited
@@ -1869,7 +2377,7 @@ Greenlet::belongs_to_thread(const ThreadState* thread_state) const
 bool
 UserGreenlet::belongs_to_thread(const ThreadState* thread_state) const
 {
-    return Greenlet::belongs_to_thread(thread_state) && this->_main_greenlet == thread_state->borrow_main_greenlet();
+    return this->_belongs_to_thread(thread_state) && this->_main_greenlet == thread_state->borrow_main_greenlet();
 }
 
 void
@@ -1879,6 +2387,14 @@ Greenlet::deallocing_greenlet_in_thread(const ThreadState* current_thread_state)
        it is not running in the same thread! */
     if (this->belongs_to_thread(current_thread_state)) {
         assert(current_thread_state);
+        // A frame object someone else can still reach would be left
+        // pointing at freed memory, so those greenlets get killed
+        // the normal way.
+        if ((this->_abandon_on_dealloc || abandon_all_on_dealloc)
+            && !this->python_state.frame_objects_referenced()) {
+            this->abandon(*current_thread_state);
+            return;
+        }
         // To get here it had to have run before
         /* Send the greenlet a GreenletExit exception. */
 
@@ -1910,7 +2426,7 @@ Greenlet::deallocing_greenlet_in_thread(const ThreadState* current_thread_state)
 
 
 int
-Greenlet::tp_traverse(visitproc visit, void* arg)
+Greenlet::_tp_traverse(visitproc visit, void* arg)
 {
 
     int result;
@@ -1934,9 +2450,10 @@ UserGreenlet::tp_traverse(visitproc visit, void* arg)
 {
     Py_VISIT(this->_parent.borrow_o());
     Py_VISIT(this->_main_greenlet.borrow_o());
+    Py_VISIT(this->_main_greenlet_of_parent.borrow_o());
     Py_VISIT(this->_run_callable.borrow_o());
 
-    return Greenlet::tp_traverse(visit, arg);
+    return this->_tp_traverse(visit, arg);
 }
 
 int
@@ -1949,7 +2466,7 @@ MainGreenlet::tp_traverse(visitproc visit, void* arg)
             return result;
         }
     }
-    return Greenlet::tp_traverse(visit, arg);
+    return this->_tp_traverse(visit, arg);
 }
 
 static int
@@ -2017,7 +2534,7 @@ green_is_gc(BorrowedGreenlet self)
 
 
 int
-Greenlet::tp_clear()
+Greenlet::_tp_clear()
 {
     bool own_top_frame = this->was_running_in_dead_thread();
     this->exception_state.tp_clear();
@@ -2028,9 +2545,10 @@ Greenlet::tp_clear()
 int
 UserGreenlet::tp_clear()
 {
-    Greenlet::tp_clear();
+    this->_tp_clear();
     this->_parent.CLEAR();
     this->_main_greenlet.CLEAR();
+    this->_main_greenlet_of_parent.CLEAR();
     this->_run_callable.CLEAR();
     return 0;
 }
@@ -2135,9 +2653,7 @@ _green_dealloc_kill_started_non_main_greenlet(BorrowedGreenlet self)
 
 Greenlet::~Greenlet()
 {
-    // XXX: Can't do this. tp_clear is a virtual function, and by the
-    // time we're here, we've sliced off our child classes.
-    //this->tp_clear();
+    // Each subclass does its own tp_clear().
 }
 
 UserGreenlet::~UserGreenlet()
@@ -2179,7 +2695,29 @@ green_dealloc(PyGreenlet* self)
         //bug in our code.
         Greenlet* p = self->pimpl;
         self->pimpl = nullptr;
-        delete p;
+        if (p == green_inline_impl(self)) {
+            // (Main greenlets of dead threads don't answer main()
+            // with true, so check the type.)
+            const bool reusable = !p->main_kind();
+            p->destroy();
+            // Keep the object, with the memory for its UserGreenlet,
+            // for green_new() to reuse, if the thread we're in still
+            // has its state.
+            ThreadState* const state = reusable ? GET_THREAD_STATE().borrow_if_exists() : nullptr;
+            if (state) {
+                self->pimpl = p;
+                if (state->keep_dead_greenlet(self)) {
+                    return;
+                }
+                self->pimpl = nullptr;
+            }
+        }
+        else {
+            // Only subclasses of greenlet get here, and those are
+            // never main greenlets.
+            assert(!p->main_kind());
+            delete static_cast<UserGreenlet*>(p);
+        }
     }
     // and finally we're done. self is now invalid.
     Py_TYPE(self)->tp_free((PyObject*)self);
@@ -2200,7 +2738,7 @@ throw_greenlet(BorrowedGreenlet self, PyErrPieces& err_pieces)
 
     self->args() <<= result;
 
-    return single_result(self->g_switch());
+    return self->g_switch(GET_THREAD_STATE().state());
 }
 
 
@@ -2225,12 +2763,102 @@ PyDoc_STRVAR(
     "function will simply return the arguments using the same rules as\n"
     "above.\n");
 
+#if GREENLET_CHECK_CALLER_STACK
 static PyObject*
-green_switch(PyGreenlet* self, PyObject* args, PyObject* kwargs)
+green_switch_fastcall(PyGreenlet* self,
+                      PyObject* const* args,
+                      Py_ssize_t nargs,
+                      PyObject* kwnames);
+
+/**
+ * If the Python frame calling us holds its own reference to *self*,
+ * or to a bound ``switch`` method of *self*, in the value stack slot
+ * just below *args*, return that object (borrowed). Otherwise,
+ * return null.
+ *
+ * That slot holds *self* for ``glet.switch(...)`` (the interpreter
+ * looks the method up without binding it), and for
+ * ``greenlet.switch(glet, ...)``, whose arguments start with it. It
+ * holds the method object for a call through one, like
+ * ``getattr(glet, 'switch')()``. Either way, the frame drops the
+ * reference when the call returns. When we're called from C, *args*
+ * isn't in the frame at all.
+ *
+ * We compare addresses before reading the slot, because *args* can
+ * point anywhere, or be null. Once it's known to be in the frame,
+ * the slot below the arguments holds the callable or its ``self``,
+ * which the frame keeps alive, or null.
+ */
+static inline PyObject*
+caller_frame_reference(const PyGreenlet* self, PyObject* const* args)
+{
+    const uintptr_t slot = reinterpret_cast<uintptr_t>(args) - sizeof(PyObject*);
+#if GREENLET_PY311
+    // The caller's frame is the last one pushed on the thread's data
+    // stack, so its value stack ends at the top of that. Frames of
+    // generators live elsewhere.
+    const PyThreadState* const tstate = PyThreadState_GET();
+    if (!tstate->datastack_chunk || !tstate->cframe->current_frame) {
+        return nullptr;
+    }
+    const uintptr_t chunk = reinterpret_cast<uintptr_t>(tstate->datastack_chunk->data);
+    const uintptr_t frame = reinterpret_cast<uintptr_t>(tstate->cframe->current_frame);
+    const uintptr_t top = reinterpret_cast<uintptr_t>(tstate->datastack_top);
+    if (!(chunk <= frame && frame < slot && slot < top)) {
+        return nullptr;
+    }
+#else
+    const PyFrameObject* const frame = PyThreadState_GET()->frame;
+    if (!frame) {
+        return nullptr;
+    }
+    const uintptr_t stack = reinterpret_cast<uintptr_t>(frame->f_valuestack);
+    const uintptr_t stack_end = stack + frame->f_code->co_stacksize * sizeof(PyObject*);
+    if (!(stack <= slot && slot < stack_end)) {
+        return nullptr;
+    }
+#endif
+    PyObject* const held = *reinterpret_cast<PyObject* const*>(slot);
+    if (held == reinterpret_cast<const PyObject*>(self)) {
+        return held;
+    }
+    if (held && PyCFunction_Check(held)
+        && PyCFunction_GET_SELF(held) == reinterpret_cast<const PyObject*>(self)
+        && PyCFunction_GET_FUNCTION(held) == reinterpret_cast<PyCFunction>(green_switch_fastcall)) {
+        return held;
+    }
+    return nullptr;
+}
+#endif
+
+static PyObject*
+green_switch_with(PyGreenlet* self,
+                  greenlet::SwitchingArgs& switch_args,
+                  PyObject* const* fastcall_args=nullptr)
 {
-    using greenlet::SwitchingArgs;
-    SwitchingArgs switch_args(OwnedObject::owning(args), OwnedObject::owning(kwargs));
     self->pimpl->args() <<= switch_args;
+    ThreadState& state = GET_THREAD_STATE().state();
+
+    // A greenlet switching into the main greenlet is often never
+    // resumed: the thread finishes, and the greenlet is thrown away
+    // without unwinding when it's deleted. Any reference the calling
+    // frame holds to the main greenlet is lost with it, which keeps
+    // the main greenlet, and what it refers to, alive forever. We
+    // note that reference here so that it can be dropped then.
+    Greenlet* origin = nullptr;
+#if GREENLET_CHECK_CALLER_STACK
+    if (fastcall_args
+        && self == state.borrow_main_greenlet()
+        && !state.is_current(state.borrow_main_greenlet())) {
+        PyObject* const held = caller_frame_reference(self, fastcall_args);
+        if (held) {
+            origin = state.borrow_current().borrow()->pimpl;
+            origin->held_by_frame(held);
+        }
+    }
+#else
+    (void)fastcall_args;
+#endif
 
 
     // If we're switching out of a greenlet, and that switch is the
@@ -2253,7 +2881,10 @@ green_switch(PyGreenlet* self, PyObject* args, PyObject* kwargs)
     // second byte of the CALL_METHOD op for ``getcurrent()``).
 
     try {
-        OwnedObject result = single_result(self->pimpl->g_switch());
+        OwnedObject result = self->pimpl->g_switch(state);
+        if (origin) {
+            origin->held_by_frame(nullptr);
+        }
 #ifndef NDEBUG
         // Note that the current greenlet isn't necessarily self. If self
         // finished, we went to one of its parents.
@@ -2266,10 +2897,49 @@ green_switch(PyGreenlet* self, PyObject* args, PyObject* kwargs)
         return result.relinquish_ownership();
     }
     catch(const PyErrOccurred&) {
+        if (origin) {
+            origin->held_by_frame(nullptr);
+        }
         return nullptr;
     }
 }
 
+static PyObject*
+green_switch(PyGreenlet* self, PyObject* args, PyObject* kwargs)
+{
+    using greenlet::SwitchingArgs;
+    SwitchingArgs switch_args(OwnedObject::owning(args), OwnedObject::owning(kwargs));
+    return green_switch_with(self, switch_args);
+}
+
+#if GREENLET_PY37
+// METH_FASTCALL | METH_KEYWORDS. The interpreter doesn't make an
+// argument tuple for us, and for the usual ``g.switch(value)`` we
+// don't make one either.
+static PyObject*
+green_switch_fastcall(PyGreenlet* self,
+                      PyObject* const* args,
+                      Py_ssize_t nargs,
+                      PyObject* kwnames)
+{
+    using greenlet::SwitchingArgs;
+    if (nargs == 1 && (!kwnames || !PyTuple_GET_SIZE(kwnames))) {
+        const BorrowedObject value(args[0]);
+        SwitchingArgs switch_args(value);
+        return green_switch_with(self, switch_args, args);
+    }
+
+    try {
+        SwitchingArgs switch_args(vectorcall_args(args, nargs),
+                                  vectorcall_kwargs(args, nargs, kwnames));
+        return green_switch_with(self, switch_args, args);
+    }
+    catch (const PyErrOccurred&) {
+        return nullptr;
+    }
+}
+#endif
+
 PyDoc_STRVAR(
     green_throw_doc,
     "Switches execution to this greenlet, but immediately raises the\n"
@@ -2290,20 +2960,12 @@ PyDoc_STRVAR(
     "from ``g_raiser`` to ``g``.\n");
 
 static PyObject*
-green_throw(PyGreenlet* self, PyObject* args)
+green_throw_with(PyGreenlet* self, PyObject* typ, PyObject* val, PyObject* tb)
 {
-    PyArgParseParam typ(mod_globs.PyExc_GreenletExit);
-    PyArgParseParam val;
-    PyArgParseParam tb;
-
-    if (!PyArg_ParseTuple(args, "|OOO:throw", &typ, &val, &tb)) {
-        return NULL;
-    }
-
     try {
         // Both normalizing the error and the actual throw_greenlet
         // could throw PyErrOccurred.
-        PyErrPieces err_pieces(typ.borrow(), val.borrow(), tb.borrow());
+        PyErrPieces err_pieces(typ, val, tb);
 
         return throw_greenlet(self, err_pieces).relinquish_ownership();
     }
@@ -2312,6 +2974,37 @@ green_throw(PyGreenlet* self, PyObject* args)
     }
 }
 
+#if GREENLET_PY37
+static PyObject*
+green_throw(PyGreenlet* self, PyObject* const* args, Py_ssize_t nargs)
+{
+    if (nargs > 3) {
+        PyErr_Format(PyExc_TypeError,
+                     "throw expected at most 3 arguments, got %zd",
+                     nargs);
+        return nullptr;
+    }
+    return green_throw_with(self,
+                            nargs > 0 ? args[0] : mod_globs.PyExc_GreenletExit.borrow(),
+                            nargs > 1 ? args[1] : nullptr,
+                            nargs > 2 ? args[2] : nullptr);
+}
+#else
+static PyObject*
+green_throw(PyGreenlet* self, PyObject* args)
+{
+    PyArgParseParam typ(mod_globs.PyExc_GreenletExit);
+    PyArgParseParam val;
+    PyArgParseParam tb;
+
+    if (!PyArg_ParseTuple(args, "|OOO:throw", &typ, &val, &tb)) {
+        return NULL;
+    }
+
+    return green_throw_with(self, typ.borrow(), val.borrow(), tb.borrow());
+}
+#endif
+
 static int
 green_bool(PyGreenlet* self)
 {
@@ -2382,6 +3075,28 @@ green_get_stack_saved(PyGreenlet* self, void* UNUSED(context))
 }
 
 
+static PyObject*
+green_getabandon(BorrowedGreenlet self, void* UNUSED(context))
+{
+    return PyBool_FromLong(self->abandon_on_dealloc());
+}
+
+static int
+green_setabandon(BorrowedGreenlet self, BorrowedObject nflag, void* UNUSED(context))
+{
+    if (!nflag) {
+        PyErr_SetString(PyExc_AttributeError, "can't delete attribute");
+        return -1;
+    }
+    const int is_true = PyObject_IsTrue(nflag);
+    if (is_true == -1) {
+        return -1;
+    }
+    self->abandon_on_dealloc(is_true);
+    return 0;
+}
+
+
 static PyObject*
 green_getrun(BorrowedGreenlet self, void* UNUSED(context))
 {
@@ -2394,6 +3109,26 @@ green_getrun(BorrowedGreenlet self, void* UNUSED(context))
     }
 }
 
+void
+UserGreenlet::stack_group(const Py_ssize_t group)
+{
+    if (this->started()) {
+        throw ValueError("cannot change the stack group "
+                         "after the start of the greenlet");
+    }
+    this->_stack_group = group;
+}
+
+void
+UserGreenlet::stack_size(const size_t size)
+{
+    if (this->started()) {
+        throw ValueError("cannot change the stack size "
+                         "after the start of the greenlet");
+    }
+    this->_stack_size = size;
+}
+
 void
 UserGreenlet::run(const BorrowedObject nrun)
 {
@@ -2471,6 +3206,7 @@ UserGreenlet::parent(const BorrowedObject raw_new_parent)
     }
 
     this->_parent = new_parent;
+    this->_main_greenlet_of_parent = new_parent->main_greenlet().borrow();
 }
 
 void
@@ -2831,15 +3567,41 @@ Extern_PyGreenlet_GET_PARENT(PyGreenlet* self)
 /** End C API ****************************************************************/
 
 static PyMethodDef green_methods[] = {
+#if GREENLET_PY37
+    {"switch",
+     reinterpret_cast<PyCFunction>(green_switch_fastcall),
+     METH_FASTCALL | METH_KEYWORDS,
+     green_switch_doc},
+    {"throw",
+     reinterpret_cast<PyCFunction>(green_throw),
+     METH_FASTCALL,
+     green_throw_doc},
+#else
     {"switch",
      reinterpret_cast<PyCFunction>(green_switch),
      METH_VARARGS | METH_KEYWORDS,
      green_switch_doc},
     {"throw", (PyCFunction)green_throw, METH_VARARGS, green_throw_doc},
+#endif
     {"__getstate__", (PyCFunction)green_getstate, METH_NOARGS, NULL},
     {NULL, NULL} /* sentinel */
 };
 
+PyDoc_STRVAR(green_abandon_on_dealloc_doc,
+             "If true, when this greenlet is deallocated while it's suspended, its\n"
+             "frames and stack are thrown away, instead of it being switched to to\n"
+             "raise GreenletExit. That's much faster, but nothing it was doing gets\n"
+             "to finish: ``finally`` blocks and ``with`` statements don't run, and\n"
+             "objects that only its frames refer to may be leaked.\n"
+             "On Python 3.11 and above, if the frame object of one of its frames\n"
+             "is still referenced from elsewhere (e.g., a saved ``sys._getframe()``\n"
+             "or a traceback), GreenletExit is raised as usual instead.\n"
+             "See also ``enable_abandon_on_dealloc()``.\n"
+             "\n"
+             "This is an implementation specific, provisional API. It may be changed or removed\n"
+             "in the future.\n"
+             ".. versionadded:: 2.0.3");
+
 static PyGetSetDef green_getsets[] = {
     {"__dict__", (getter)green_getdict, (setter)green_setdict, /*XXX*/ NULL},
     {"run", (getter)green_getrun, (setter)green_setrun, /*XXX*/ NULL},
@@ -2851,6 +3613,10 @@ static PyGetSetDef green_getsets[] = {
      /*XXX*/ NULL},
     {"dead", (getter)green_getdead, NULL, /*XXX*/ NULL},
     {"_stack_saved", (getter)green_get_stack_saved, NULL, /*XXX*/ NULL},
+    {"abandon_on_dealloc",
+     (getter)green_getabandon,
+     (setter)green_setabandon,
+     green_abandon_on_dealloc_doc},
     {NULL}};
 
 static PyMemberDef green_members[] = {
@@ -2896,11 +3662,15 @@ PyTypeObject PyGreenlet_Type = {
     0,                         /* tp_setattro */
     0,                         /* tp_as_buffer*/
     G_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /* tp_flags */
-    "greenlet(run=None, parent=None) -> greenlet\n\n"
+    "greenlet(run=None, parent=None, stack_size=None, stack_group=None) -> greenlet\n\n"
     "Creates a new greenlet object (without running it).\n\n"
     " - *run* -- The callable to invoke.\n"
     " - *parent* -- The parent greenlet. The default is the current "
-    "greenlet.",                        /* tp_doc */
+    "greenlet.\n"
+    " - *stack_size* -- If not 0, run on a dedicated C stack of this "
+    "many bytes. The default is given by :func:`stack_size`.\n"
+    " - *stack_group* -- If given, run on the C stack this thread "
+    "shares among all greenlets of that group (0 to 63).",  /* tp_doc */
     (traverseproc)green_traverse, /* tp_traverse */
     (inquiry)green_clear,         /* tp_clear */
     0,                                  /* tp_richcompare */
@@ -2936,6 +3706,162 @@ mod_getcurrent(PyObject* UNUSED(module))
     return GET_THREAD_STATE().state().get_current().relinquish_ownership_o();
 }
 
+/**
+ * Can *victim* be given *current*, the running greenlet of *state*,
+ * as its parent? That isn't the case for main greenlets, greenlets
+ * of other threads (which can't be switched to anyway), *current*
+ * itself, or greenlets *current* descends from.
+ */
+static bool
+can_reparent_to_current(ThreadState& state, BorrowedGreenlet victim, BorrowedGreenlet current)
+{
+    if (victim->main_kind()
+        || victim->find_main_greenlet_in_lineage() != state.borrow_main_greenlet()) {
+        return false;
+    }
+    for (BorrowedGreenlet p = current; p; p = p->parent()) {
+        if (p == victim) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Raise *exc*, an exception class or instance, in *victim* the way
+ * ``victim.throw(exc)`` does. When possible, the current greenlet is
+ * its parent in the meantime, so that it comes back here when it
+ * dies. Returns what the switch returned, or the exception it raised.
+ *
+ * A class is instantiated anew. An instance is left with the
+ * traceback and context it came with, since it's shared with the
+ * caller and the other victims.
+ */
+static OwnedObject
+kill_greenlet(ThreadState& state, BorrowedGreenlet victim, PyObject* exc)
+{
+    const BorrowedGreenlet current = state.borrow_current();
+    OwnedGreenlet old_parent;
+    OwnedObject result;
+    // Raising an instance in frames that catch it sets these.
+    const bool shared = PyExceptionInstance_Check(exc);
+    OwnedObject saved_traceback;
+    OwnedObject saved_context;
+    if (shared) {
+        saved_traceback = OwnedObject::consuming(PyException_GetTraceback(exc));
+        saved_context = OwnedObject::consuming(PyException_GetContext(exc));
+    }
+    try {
+        if (can_reparent_to_current(state, victim, current)) {
+            old_parent = victim->parent();
+            if (old_parent == current) {
+                old_parent.CLEAR();
+            }
+            else {
+                victim->parent(current.borrow_o());
+            }
+        }
+        PyErrPieces(exc, nullptr, nullptr).PyErrRestore();
+        if (victim->started() && !victim->active()) {
+            /* dead greenlet: turn GreenletExit into a regular return */
+            result = g_handle_exit(OwnedObject());
+        }
+        victim->args() <<= result;
+        result = victim->g_switch(state);
+    }
+    catch (const PyErrOccurred&) {
+        PyObject* typ;
+        PyObject* val;
+        PyObject* tb;
+        PyErr_Fetch(&typ, &val, &tb);
+        PyErr_NormalizeException(&typ, &val, &tb);
+        if (tb && val != exc) {
+            PyException_SetTraceback(val, tb);
+        }
+        Py_XDECREF(typ);
+        Py_XDECREF(tb);
+        result = OwnedObject::consuming(val);
+    }
+    if (shared) {
+        PyException_SetTraceback(exc, saved_traceback ? saved_traceback.borrow() : Py_None);
+        PyException_SetContext(exc, saved_context.relinquish_ownership());
+    }
+    if (old_parent) {
+        try {
+            victim->parent(old_parent.borrow_o());
+        }
+        catch (const PyErrOccurred&) {
+            // It has been given a new parent that old_parent descends
+            // from. Leave it there.
+            PyErr_Clear();
+        }
+    }
+    return result;
+}
+
+PyDoc_STRVAR(mod_killall_doc,
+             "killall(greenlets, exc=GreenletExit) -> list\n"
+             "\n"
+             "Raise *exc* in each of the iterable *greenlets* in turn, as if by\n"
+             "``throw(exc)``, and return a list with, for each of them, what\n"
+             "``throw()`` would have returned, or the exception it would have raised.\n"
+             "This is much faster than calling ``throw()`` on each greenlet.\n"
+             "\n"
+             "*exc* is checked only once. If it's a class, each greenlet gets an\n"
+             "instance of its own. If it's an instance, they all get that object,\n"
+             "and its ``__traceback__`` and ``__context__`` are left as they were.\n"
+             "While *exc* is raised in a greenlet, its parent is the current\n"
+             "greenlet, so that it comes back here when it dies (unless it's a\n"
+             "main greenlet or the current greenlet descends from it).\n");
+static PyObject*
+mod_killall(PyObject* UNUSED(module), PyObject* args, PyObject* kwargs)
+{
+    PyArgParseParam greenlets;
+    PyArgParseParam exc(mod_globs.PyExc_GreenletExit);
+    static const char* const kwlist[] = {
+        "greenlets",
+        "exc",
+        NULL
+    };
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O:killall", (char**)kwlist,
+                                     &greenlets, &exc)) {
+        return nullptr;
+    }
+    try {
+        if (!PyExceptionClass_Check(exc.borrow())
+            && !PyExceptionInstance_Check(exc.borrow())) {
+            PyErr_Format(PyExc_TypeError,
+                         "exceptions must be classes, or instances, not %s",
+                         Py_TYPE(exc.borrow())->tp_name);
+            return nullptr;
+        }
+        // A tuple, so that the greenlets we switch to can't change
+        // it under us.
+        const OwnedObject victims = OwnedObject::consuming(Require(PySequence_Tuple(greenlets.borrow())));
+        const Py_ssize_t count = PyTuple_GET_SIZE(victims.borrow());
+        for (Py_ssize_t i = 0; i < count; i++) {
+            PyObject* const victim = PyTuple_GET_ITEM(victims.borrow(), i);
+            if (!PyGreenlet_Check(victim)) {
+                PyErr_Format(PyExc_TypeError,
+                             "killall() expected greenlets, not %s",
+                             Py_TYPE(victim)->tp_name);
+                return nullptr;
+            }
+        }
+        OwnedObject results = OwnedObject::consuming(Require(PyList_New(count)));
+        ThreadState& state = GET_THREAD_STATE().state();
+        for (Py_ssize_t i = 0; i < count; i++) {
+            BorrowedGreenlet victim(PyTuple_GET_ITEM(victims.borrow(), i));
+            PyList_SET_ITEM(results.borrow(), i,
+                            kill_greenlet(state, victim, exc.borrow()).relinquish_ownership());
+        }
+        return results.relinquish_ownership();
+    }
+    catch (const PyErrOccurred&) {
+        return nullptr;
+    }
+}
+
 PyDoc_STRVAR(mod_settrace_doc,
              "settrace(callback) -> object\n"
              "\n"
@@ -3028,12 +3954,11 @@ PyDoc_STRVAR(mod_get_clocks_used_doing_optional_cleanup_doc,
              "Get the number of clock ticks the program has used doing optional "
              "greenlet cleanup.\n"
              "Beginning in greenlet 2.0, greenlet tries to find and dispose of greenlets\n"
-             "that leaked after a thread exited. This requires invoking Python's garbage collector,\n"
-             "which may have a performance cost proportional to the number of live objects.\n"
+             "that leaked after a thread exited. This used to require invoking Python's garbage collector,\n"
+             "which had a performance cost proportional to the number of live objects.\n"
              "This function returns the amount of processor time\n"
-             "greenlet has used to do this. In programs that run with very large amounts of live\n"
-             "objects, this metric can be used to decide whether the cost of doing this cleanup\n"
-             "is worth the memory leak being corrected. If not, you can disable the cleanup\n"
+             "greenlet has used to do this. Greenlets now keep track of the references that\n"
+             "would leak instead, so this is always 0. You can still disable the cleanup\n"
              "using ``enable_optional_cleanup(False)``.\n"
              "The units are arbitrary and can only be compared to themselves (similarly to ``time.clock()``);\n"
              "for example, to see how it scales with your heap. You can attempt to convert them into seconds\n"
@@ -3095,11 +4020,298 @@ mod_get_tstate_trash_delete_nesting(PyObject* UNUSED(module))
     return PyLong_FromLong(tstate->trash_delete_nesting);
 }
 
+PyDoc_STRVAR(mod_stack_size_doc,
+             "stack_size([size]) -> Integer\n"
+             "\n"
+             "Return the stack size used for greenlets created without an explicit\n"
+             "``stack_size``. If *size* is given, it becomes the new default for\n"
+             "greenlets created afterwards, and the previous value is returned.\n"
+             "\n"
+             "0 (the default) means greenlets share the C stack of their thread,\n"
+             "saving and restoring the parts of it they use when switching.\n"
+             "Otherwise, each greenlet is given a stack of its own of (at least)\n"
+             "that many bytes when started, and switching between greenlets on\n"
+             "different stacks copies nothing. The minimum is 4 MiB, enough to\n"
+             "reach the default recursion limit.\n"
+             "\n"
+             ".. versionadded:: 2.0.3"
+             );
+static PyObject*
+mod_stack_size(PyObject* UNUSED(module), PyObject* args)
+{
+    Py_ssize_t new_size = -1;
+    if (!PyArg_ParseTuple(args, "|n:stack_size", &new_size)) {
+        return nullptr;
+    }
+    const size_t old_size = default_stack_size;
+    if (PyTuple_GET_SIZE(args)) {
+        try {
+            default_stack_size = green_check_stack_size(new_size);
+        }
+        catch (const PyErrOccurred&) {
+            return nullptr;
+        }
+    }
+    return PyLong_FromSize_t(old_size);
+}
+
+PyDoc_STRVAR(mod_trim_stack_pool_doc,
+             "trim_stack_pool() -> Integer\n"
+             "\n"
+             "Free the buffers the current thread keeps around for saving greenlet\n"
+             "stacks, and (on Python 3.11 and newer) the memory for Python frames\n"
+             "it keeps to give to new greenlets, and return the number of bytes\n"
+             "freed. The caches are bounded, but this can be used to give memory\n"
+             "back after a burst of activity. This also forgets the stack sizes\n"
+             "learned for all threads (see ``get_learned_stack_sizes()``).\n"
+             "\n"
+             ".. versionadded:: 2.0.3"
+             );
+static PyObject*
+mod_trim_stack_pool(PyObject* UNUSED(module))
+{
+    ThreadState& state = GET_THREAD_STATE().state();
+    PyDict_Clear(mod_globs.learned_stack_sizes.borrow());
+    return PyLong_FromSize_t(state.stack_copy_pool().trim()
+                             + state.frame_chunk_cache().trim());
+}
+
+PyDoc_STRVAR(mod_enable_stack_copy_retention_doc,
+             "enable_stack_copy_retention(bool) -> None\n"
+             "\n"
+             "If true, a greenlet keeps the heap copy of its stack after it's\n"
+             "restored, and the next time that stack has to be saved, only the\n"
+             "parts that changed are written to it. This trades memory for less\n"
+             "copying when greenlets are repeatedly suspended at the same depth.\n"
+             "See ``get_stack_stats()`` to decide whether it's worth it.\n"
+             "\n"
+             "This is an implementation specific, provisional API. It may be changed or removed\n"
+             "in the future.\n"
+             ".. versionadded:: 2.0.3"
+             );
+static PyObject*
+mod_enable_stack_copy_retention(PyObject* UNUSED(module), PyObject* flag)
+{
+    int is_true = PyObject_IsTrue(flag);
+    if (is_true == -1) {
+        return nullptr;
+    }
+    StackState::retain_copies = is_true;
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(mod_enable_abandon_on_dealloc_doc,
+             "enable_abandon_on_dealloc(bool) -> bool\n"
+             "\n"
+             "If true, every greenlet that's deallocated while it's suspended is\n"
+             "abandoned, as if its ``abandon_on_dealloc`` attribute was true: its\n"
+             "frames and stack are thrown away without switching to it, so no\n"
+             "``finally`` blocks run. This is meant for dropping large numbers of\n"
+             "idle greenlets quickly, for example when a process is shutting down.\n"
+             "Returns the previous value.\n"
+             "\n"
+             "This is an implementation specific, provisional API. It may be changed or removed\n"
+             "in the future.\n"
+             ".. versionadded:: 2.0.3"
+             );
+static PyObject*
+mod_enable_abandon_on_dealloc(PyObject* UNUSED(module), PyObject* flag)
+{
+    const int is_true = PyObject_IsTrue(flag);
+    if (is_true == -1) {
+        return nullptr;
+    }
+    const bool old = abandon_all_on_dealloc;
+    abandon_all_on_dealloc = is_true;
+    return PyBool_FromLong(old);
+}
+
+PyDoc_STRVAR(mod_enable_stack_compression_doc,
+             "enable_stack_compression(after_switches) -> Integer\n"
+             "\n"
+             "Compress the saved stack of a suspended greenlet once *after_switches*\n"
+             "switches have happened in its thread without it being resumed; it is\n"
+             "decompressed when the greenlet is switched to. This saves memory when\n"
+             "there are many greenlets that are idle for a long time, at the cost of\n"
+             "some CPU time (see ``get_stack_stats()``). 0 (the default) disables\n"
+             "compression. Returns the previous value.\n"
+             "\n"
+             "This is an implementation specific, provisional API. It may be changed or removed\n"
+             "in the future.\n"
+             ".. versionadded:: 2.0.3"
+             );
+static PyObject*
+mod_enable_stack_compression(PyObject* UNUSED(module), PyObject* args)
+{
+    Py_ssize_t after_switches;
+    if (!PyArg_ParseTuple(args, "n:enable_stack_compression", &after_switches)) {
+        return nullptr;
+    }
+    if (after_switches < 0) {
+        PyErr_SetString(PyExc_ValueError, "after_switches must not be negative");
+        return nullptr;
+    }
+    const size_t old = StackState::compress_after_switches;
+    StackState::compress_after_switches = after_switches;
+    return PyLong_FromSize_t(old);
+}
+
+PyDoc_STRVAR(mod_set_stack_memory_limit_doc,
+             "set_stack_memory_limit(nbytes) -> Integer\n"
+             "\n"
+             "Limit the memory used by the saved stacks of suspended greenlets, in\n"
+             "all threads, to about *nbytes*. When a switch leaves more than that in\n"
+             "use, the thread moves its least recently saved stacks to a temporary\n"
+             "file that is mapped into memory, where the operating system can page\n"
+             "them out. They are read back when the greenlet is switched to.\n"
+             "Space in the file used by stacks spilled before a ``fork()`` isn't\n"
+             "reused afterwards, since the other process may still read them;\n"
+             "the child spills to a file of its own.\n"
+             "0 (the default) means no limit. Returns the previous limit.\n"
+             "\n"
+             "This is an implementation specific, provisional API. It may be changed or removed\n"
+             "in the future.\n"
+             ".. versionadded:: 2.0.3"
+             );
+static PyObject*
+mod_set_stack_memory_limit(PyObject* UNUSED(module), PyObject* args)
+{
+    Py_ssize_t limit;
+    if (!PyArg_ParseTuple(args, "n:set_stack_memory_limit", &limit)) {
+        return nullptr;
+    }
+    if (limit < 0) {
+        PyErr_SetString(PyExc_ValueError, "nbytes must not be negative");
+        return nullptr;
+    }
+    const size_t old = StackState::bytes_in_memory_limit;
+    StackState::bytes_in_memory_limit = limit;
+    return PyLong_FromSize_t(old);
+}
+
+PyDoc_STRVAR(mod_compact_stacks_doc,
+             "compact_stacks() -> Integer\n"
+             "\n"
+             "Give back memory held for greenlet stacks in the current thread that\n"
+             "isn't needed right now: saved stacks are shrunk to fit, copies kept by\n"
+             "``enable_stack_copy_retention()`` are dropped, and the cache emptied\n"
+             "(see ``trim_stack_pool()``). Returns the number of bytes reclaimed.\n"
+             "\n"
+             "This is an implementation specific, provisional API. It may be changed or removed\n"
+             "in the future.\n"
+             ".. versionadded:: 2.0.3"
+             );
+static PyObject*
+mod_compact_stacks(PyObject* UNUSED(module))
+{
+    return PyLong_FromSize_t(GET_THREAD_STATE().state().stack_copy_pool().compact());
+}
+
+PyDoc_STRVAR(mod_set_stack_compaction_interval_doc,
+             "set_stack_compaction_interval(switches) -> Integer\n"
+             "\n"
+             "Have each thread do what ``compact_stacks()`` does every *switches*\n"
+             "greenlet switches. 0 (the default) disables this. Returns the previous\n"
+             "value.\n"
+             "\n"
+             "This is an implementation specific, provisional API. It may be changed or removed\n"
+             "in the future.\n"
+             ".. versionadded:: 2.0.3"
+             );
+static PyObject*
+mod_set_stack_compaction_interval(PyObject* UNUSED(module), PyObject* args)
+{
+    Py_ssize_t interval;
+    if (!PyArg_ParseTuple(args, "n:set_stack_compaction_interval", &interval)) {
+        return nullptr;
+    }
+    if (interval < 0) {
+        PyErr_SetString(PyExc_ValueError, "switches must not be negative");
+        return nullptr;
+    }
+    const size_t old = StackState::compaction_interval;
+    StackState::compaction_interval = interval;
+    return PyLong_FromSize_t(old);
+}
+
+PyDoc_STRVAR(mod_get_learned_stack_sizes_doc,
+             "get_learned_stack_sizes() -> dict\n"
+             "\n"
+             "Return a new dictionary mapping the code objects of greenlet ``run``\n"
+             "functions to about how much stack, in bytes, greenlets running that\n"
+             "code have had to save (a moving average, capped at 1MB). New greenlets\n"
+             "running the same code allocate that much space up front when their\n"
+             "stack is first saved. ``trim_stack_pool()`` empties it.\n"
+             "\n"
+             "This is an implementation specific, provisional API. It may be changed or removed\n"
+             "in the future.\n"
+             ".. versionadded:: 2.0.3"
+             );
+static PyObject*
+mod_get_learned_stack_sizes(PyObject* UNUSED(module))
+{
+    return PyDict_Copy(mod_globs.learned_stack_sizes.borrow());
+}
+
+PyDoc_STRVAR(mod_get_stack_stats_doc,
+             "get_stack_stats() -> dict\n"
+             "\n"
+             "Return statistics about saving greenlet stacks in the current thread:\n"
+             "\n"
+             "- ``bytes_saved``: the number of bytes of stack saved to the heap.\n"
+             "- ``bytes_skipped``: how many of those didn't have to be written\n"
+             "  because a retained copy already had them (see\n"
+             "  ``enable_stack_copy_retention()``).\n"
+             "- ``bytes_pooled``: bytes cached for reuse (see ``trim_stack_pool()``).\n"
+             "- ``switches_within_stack``: switches between greenlets sharing a C stack.\n"
+             "- ``switches_across_stacks``: switches between greenlets on different C\n"
+             "  stacks (see the ``stack_size`` and ``stack_group`` arguments to ``greenlet``),\n"
+             "  which don't copy anything.\n"
+             "- ``bytes_compressed``: bytes of saved stack compressed (see\n"
+             "  ``enable_stack_compression()``), and ``bytes_compressed_to``, the\n"
+             "  size they were compressed to.\n"
+             "- ``clocks_compressing``: clock ticks spent compressing and decompressing\n"
+             "  (see ``CLOCKS_PER_SEC``).\n"
+             "- ``bytes_spilled``: bytes of saved stack moved out of memory (see\n"
+             "  ``set_stack_memory_limit()``).\n"
+             "- ``bytes_in_memory``: the memory currently used by saved stacks in all\n"
+             "  threads.\n"
+             "- ``buffers_grown``: how many times a saved stack outgrew the memory\n"
+             "  allocated for it (see ``get_learned_stack_sizes()``).\n"
+             "- ``bytes_compacted``: bytes given back by ``compact_stacks()``.\n"
+             "\n"
+             "This is an implementation specific, provisional API. It may be changed or removed\n"
+             "in the future.\n"
+             ".. versionadded:: 2.0.3"
+             );
+static PyObject*
+mod_get_stack_stats(PyObject* UNUSED(module))
+{
+    const greenlet::StackCopyPool& pool = GET_THREAD_STATE().state().stack_copy_pool();
+    return Py_BuildValue("{s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:n}",
+                         "bytes_saved", (Py_ssize_t)pool.bytes_saved,
+                         "bytes_skipped", (Py_ssize_t)pool.bytes_skipped,
+                         "bytes_pooled", (Py_ssize_t)pool.pooled_bytes(),
+                         "switches_within_stack", (Py_ssize_t)pool.switches_within_stack,
+                         "switches_across_stacks", (Py_ssize_t)pool.switches_across_stacks,
+                         "bytes_compressed", (Py_ssize_t)pool.bytes_compressed,
+                         "bytes_compressed_to", (Py_ssize_t)pool.bytes_compressed_to,
+                         "clocks_compressing", (Py_ssize_t)pool.clocks_compressing,
+                         "bytes_spilled", (Py_ssize_t)pool.bytes_spilled,
+                         "bytes_in_memory", (Py_ssize_t)StackState::bytes_in_memory,
+                         "buffers_grown", (Py_ssize_t)pool.buffers_grown,
+                         "bytes_compacted", (Py_ssize_t)pool.bytes_compacted);
+}
+
 static PyMethodDef GreenMethods[] = {
     {"getcurrent",
      (PyCFunction)mod_getcurrent,
      METH_NOARGS,
      mod_getcurrent_doc},
+    {"killall",
+     reinterpret_cast<PyCFunction>(mod_killall),
+     METH_VARARGS | METH_KEYWORDS,
+     mod_killall_doc},
     {"settrace", (PyCFunction)mod_settrace, METH_VARARGS, mod_settrace_doc},
     {"gettrace", (PyCFunction)mod_gettrace, METH_NOARGS, mod_gettrace_doc},
     {"set_thread_local", (PyCFunction)mod_set_thread_local, METH_VARARGS, mod_set_thread_local_doc},
@@ -3108,6 +4320,16 @@ static PyMethodDef GreenMethods[] = {
     {"get_clocks_used_doing_optional_cleanup", (PyCFunction)mod_get_clocks_used_doing_optional_cleanup, METH_NOARGS, mod_get_clocks_used_doing_optional_cleanup_doc},
     {"enable_optional_cleanup", (PyCFunction)mod_enable_optional_cleanup, METH_O, mod_enable_optional_cleanup_doc},
     {"get_tstate_trash_delete_nesting", (PyCFunction)mod_get_tstate_trash_delete_nesting, METH_NOARGS, mod_get_tstate_trash_delete_nesting_doc},
+    {"stack_size", (PyCFunction)mod_stack_size, METH_VARARGS, mod_stack_size_doc},
+    {"trim_stack_pool", (PyCFunction)mod_trim_stack_pool, METH_NOARGS, mod_trim_stack_pool_doc},
+    {"enable_stack_copy_retention", (PyCFunction)mod_enable_stack_copy_retention, METH_O, mod_enable_stack_copy_retention_doc},
+    {"enable_abandon_on_dealloc", (PyCFunction)mod_enable_abandon_on_dealloc, METH_O, mod_enable_abandon_on_dealloc_doc},
+    {"enable_stack_compression", (PyCFunction)mod_enable_stack_compression, METH_VARARGS, mod_enable_stack_compression_doc},
+    {"set_stack_memory_limit", (PyCFunction)mod_set_stack_memory_limit, METH_VARARGS, mod_set_stack_memory_limit_doc},
+    {"compact_stacks", (PyCFunction)mod_compact_stacks, METH_NOARGS, mod_compact_stacks_doc},
+    {"set_stack_compaction_interval", (PyCFunction)mod_set_stack_compaction_interval, METH_VARARGS, mod_set_stack_compaction_interval_doc},
+    {"get_learned_stack_sizes", (PyCFunction)mod_get_learned_stack_sizes, METH_NOARGS, mod_get_learned_stack_sizes_doc},
+    {"get_stack_stats", (PyCFunction)mod_get_stack_stats, METH_NOARGS, mod_get_stack_stats_doc},
     {NULL, NULL} /* Sentinel */
 };
 
@@ -3139,6 +4361,9 @@ greenlet_internal_mod_init() G_NOEXCEPT
     try {
         CreatedModule m(greenlet_module_def);
 
+#if GREENLET_USE_TYPE_VECTORCALL
+        PyGreenlet_Type.tp_vectorcall = green_vectorcall;
+#endif
         Require(PyType_Ready(&PyGreenlet_Type));
 
 #if G_USE_STANDARD_THREADING == 0
@@ -3158,6 +4383,8 @@ greenlet_internal_mod_init() G_NOEXCEPT
         // the same as NULL, which is ambiguous with a pointer.
         m.PyAddObject("GREENLET_USE_CONTEXT_VARS", (long)GREENLET_PY37);
         m.PyAddObject("GREENLET_USE_STANDARD_THREADING", (long)G_USE_STANDARD_THREADING);
+        m.PyAddObject("GREENLET_USE_DEDICATED_STACKS", (long)GREENLET_USE_DEDICATED_STACKS);
+        m.PyAddObject("GREENLET_USE_LEAN_SWITCH", (long)GREENLET_USE_LEAN_SWITCH);
 
         OwnedObject clocks_per_sec = OwnedObject::consuming(PyLong_FromSsize_t(CLOCKS_PER_SEC));
         m.PyAddObject("CLOCKS_PER_SEC", clocks_per_sec);
@@ -3215,6 +4442,8 @@ greenlet_internal_mod_init() G_NOEXCEPT
         //      << "\n\tExceptionState : " << sizeof(greenlet::ExceptionState)
         //      << "\n\tPythonState    : " << sizeof(greenlet::PythonState)
         //      << "\n\tStackState     : " << sizeof(greenlet::StackState)
+        //      << "\n\tStackCopyPool  : " << sizeof(greenlet::StackCopyPool)
+        //      << "\n\tThreadState    : " << sizeof(ThreadState)
         //      << "\n\tSwitchingArgs  : " << sizeof(greenlet::SwitchingArgs)
         //      << "\n\tOwnedObject    : " << sizeof(greenlet::refs::OwnedObject)
         //      << "\n\tBorrowedObject : " << sizeof(greenlet::refs::BorrowedObject)
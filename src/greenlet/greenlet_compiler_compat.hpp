@@ -58,12 +58,22 @@ typedef unsigned int uint32_t;
 // in non-type template arguments. Translation: function pointer
 // template arguments cannot be for static functions.
 #define G_FP_TMPL_STATIC
+// Nor static_assert.
+#define G_STATIC_ASSERT(cond, message)
+// Nor rvalue references. G_MOVE() copies instead, so the
+// source must still be cleared afterwards.
+#define G_HAS_MOVE_SEMANTICS 0
+#define G_MOVE(x) (x)
 #else
 // Newer, reasonable compilers implementing C++11 or so.
 #include <cstdint>
+#include <utility>
 #define G_HAS_METHOD_DELETE 1
 #define G_EXPLICIT_OP explicit
 #define G_NOEXCEPT noexcept
+#define G_STATIC_ASSERT(cond, message) static_assert(cond, message)
+#define G_HAS_MOVE_SEMANTICS 1
+#define G_MOVE(x) std::move(x)
 # if defined(__clang__)
 #  define G_FP_TMPL_STATIC static
 # else
@@ -128,5 +138,20 @@ typedef unsigned int uint32_t;
 #    define G_NOEXCEPT_WIN32
 #endif
 
+// A static assertion using ``offsetof``, to check that members used
+// together are laid out together. Our classes with mixed access
+// control aren't standard-layout, so strictly speaking their offsets
+// are only conditionally supported, and GCC and clang warn; but all
+// the compilers we support lay out members in declaration order.
+#if defined(__GNUC__) || defined(__clang__)
+#    define G_LAYOUT_ASSERT(cond, message)                           \
+    _Pragma("GCC diagnostic push")                                  \
+    _Pragma("GCC diagnostic ignored \"-Winvalid-offsetof\"")        \
+    G_STATIC_ASSERT(cond, message);                                 \
+    _Pragma("GCC diagnostic pop")
+#else
+#    define G_LAYOUT_ASSERT(cond, message) G_STATIC_ASSERT(cond, message)
+#endif
+
 
 #endif
@@ -0,0 +1,228 @@
+#ifndef GREENLET_COMPRESSION_HPP
+#define GREENLET_COMPRESSION_HPP
+
+/**
+ * A small, fast LZ77 codec for compressing saved stacks.
+ *
+ * The format is the LZ4 block format: a sequence of tokens, each
+ * giving a run of literal bytes followed by a match (an offset of up
+ * to 64KB back into the output and a length of at least 4). We only
+ * ever decompress what we compressed ourselves, so there are no
+ * frames or checksums; decompress() still checks its bounds.
+ *
+ * Saved stacks are mostly zeros, pointers into a handful of regions,
+ * and repeated frame layouts, which this handles well and quickly.
+ */
+
+#include <cstring>
+#include "greenlet_compiler_compat.hpp"
+
+namespace greenlet {
+namespace compression {
+
+    typedef unsigned char byte_t;
+
+    static const unsigned HASH_BITS = 12;
+    // The number of bytes compress() needs for its hash table.
+    static const size_t TABLE_SIZE = sizeof(unsigned) << HASH_BITS;
+    static const size_t MIN_MATCH = 4;
+    // As in LZ4, the last bytes are always literals, so the match
+    // loop can read ahead without checking.
+    static const size_t LAST_LITERALS = 5;
+    static const size_t MATCH_SAFETY = 12;
+    static const size_t MAX_OFFSET = 65535;
+
+    inline unsigned read32(const byte_t* p)
+    {
+        unsigned v;
+        memcpy(&v, p, 4);
+        return v;
+    }
+
+    inline unsigned hash32(const unsigned v)
+    {
+        return (v * 2654435761U) >> (32 - HASH_BITS);
+    }
+
+    inline byte_t* write_length(byte_t* op, size_t length)
+    {
+        while (length >= 255) {
+            *op++ = 255;
+            length -= 255;
+        }
+        *op++ = (byte_t)length;
+        return op;
+    }
+
+    /**
+     * Compress *size* bytes from *src* into *dest*, which has room
+     * for *capacity* bytes. Returns the compressed size, or 0 if it
+     * wouldn't fit.
+     *
+     * *table* is scratch space of TABLE_SIZE bytes. (We may be
+     * running on a small dedicated stack, so it isn't a local.)
+     */
+    inline size_t compress(const char* const src, const size_t size,
+                           char* const dest, const size_t capacity,
+                           unsigned* const table) G_NOEXCEPT
+    {
+        const byte_t* const base = (const byte_t*)src;
+        const byte_t* const iend = base + size;
+        const byte_t* ip = base;
+        const byte_t* anchor = base;
+        byte_t* op = (byte_t*)dest;
+        byte_t* const oend = op + capacity;
+
+        if (size > MATCH_SAFETY) {
+            const byte_t* const mflimit = iend - MATCH_SAFETY;
+            const byte_t* const matchlimit = iend - LAST_LITERALS;
+            // Positions relative to base; 0 is a real position, so a
+            // fresh table just gives (checked) candidates at the start.
+            memset(table, 0, TABLE_SIZE);
+            ip++;
+            while (ip < mflimit) {
+                const unsigned sequence = read32(ip);
+                const unsigned h = hash32(sequence);
+                const byte_t* ref = base + table[h];
+                table[h] = (unsigned)(ip - base);
+                if ((size_t)(ip - ref) > MAX_OFFSET || read32(ref) != sequence) {
+                    // Skip faster through data that isn't compressing.
+                    ip += 1 + ((ip - anchor) >> 6);
+                    continue;
+                }
+                // Extend backwards over literals, then forwards.
+                while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                    ip--;
+                    ref--;
+                }
+                const byte_t* mp = ip + MIN_MATCH;
+                const byte_t* rp = ref + MIN_MATCH;
+                while (mp < matchlimit && *mp == *rp) {
+                    mp++;
+                    rp++;
+                }
+
+                const size_t literals = ip - anchor;
+                const size_t match = (mp - ip) - MIN_MATCH;
+                if (op + 1 + literals + literals / 255 + 1 + 2 + match / 255 + 1 > oend) {
+                    return 0;
+                }
+                byte_t* const token = op++;
+                if (literals >= 15) {
+                    *token = 15 << 4;
+                    op = write_length(op, literals - 15);
+                }
+                else {
+                    *token = (byte_t)(literals << 4);
+                }
+                memcpy(op, anchor, literals);
+                op += literals;
+                const size_t offset = ip - ref;
+                *op++ = (byte_t)offset;
+                *op++ = (byte_t)(offset >> 8);
+                if (match >= 15) {
+                    *token |= 15;
+                    op = write_length(op, match - 15);
+                }
+                else {
+                    *token |= (byte_t)match;
+                }
+                ip = anchor = mp;
+            }
+        }
+
+        const size_t literals = iend - anchor;
+        if (op + 1 + literals + literals / 255 + 1 > oend) {
+            return 0;
+        }
+        if (literals >= 15) {
+            *op++ = 15 << 4;
+            op = write_length(op, literals - 15);
+        }
+        else {
+            *op++ = (byte_t)(literals << 4);
+        }
+        memcpy(op, anchor, literals);
+        op += literals;
+        return op - (byte_t*)dest;
+    }
+
+    /**
+     * Decompress *size* bytes from *src*, which must produce exactly
+     * *dest_size* bytes at *dest*. Returns false if the data is
+     * corrupt.
+     */
+    inline bool decompress(const char* const src, const size_t size,
+                           char* const dest, const size_t dest_size) G_NOEXCEPT
+    {
+        const byte_t* ip = (const byte_t*)src;
+        const byte_t* const iend = ip + size;
+        byte_t* op = (byte_t*)dest;
+        byte_t* const oend = op + dest_size;
+
+        while (ip < iend) {
+            const unsigned token = *ip++;
+            size_t length = token >> 4;
+            if (length == 15) {
+                unsigned b;
+                do {
+                    if (ip >= iend) {
+                        return false;
+                    }
+                    b = *ip++;
+                    length += b;
+                } while (b == 255);
+            }
+            if (length > (size_t)(iend - ip) || length > (size_t)(oend - op)) {
+                return false;
+            }
+            memcpy(op, ip, length);
+            op += length;
+            ip += length;
+            if (ip == iend) {
+                // The last sequence has only literals.
+                break;
+            }
+
+            if (iend - ip < 2) {
+                return false;
+            }
+            const size_t offset = ip[0] | (ip[1] << 8);
+            ip += 2;
+            if (offset == 0 || offset > (size_t)(op - (byte_t*)dest)) {
+                return false;
+            }
+            length = token & 15;
+            if (length == 15) {
+                unsigned b;
+                do {
+                    if (ip >= iend) {
+                        return false;
+                    }
+                    b = *ip++;
+                    length += b;
+                } while (b == 255);
+            }
+            length += MIN_MATCH;
+            if (length > (size_t)(oend - op)) {
+                return false;
+            }
+            const byte_t* match = op - offset;
+            if (offset >= length) {
+                memcpy(op, match, length);
+                op += length;
+            }
+            else {
+                // Overlapping: a repeating pattern.
+                for (size_t i = 0; i < length; i++) {
+                    *op++ = *match++;
+                }
+            }
+        }
+        return op == oend;
+    }
+
+}; // namespace compression
+}; // namespace greenlet
+
+#endif
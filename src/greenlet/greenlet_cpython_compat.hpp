@@ -48,6 +48,16 @@ We have to save and restore this as well.
 #    define GREENLET_USE_CFRAME 0
 #endif
 
+#if PY_VERSION_HEX >= 0x30900A1
+/*
+Python 3.9 calls type objects through their tp_vectorcall slot, if
+set. (Earlier versions have the slot but don't use it for types.)
+*/
+#    define GREENLET_USE_TYPE_VECTORCALL 1
+#else
+#    define GREENLET_USE_TYPE_VECTORCALL 0
+#endif
+
 #if PY_VERSION_HEX >= 0x30B00A4
 /*
 Greenlet won't compile on anything older than Python 3.11 alpha 4 (see
@@ -66,12 +76,28 @@ https://bugs.python.org/issue46090). Summary of breaking internal changes:
 #    define GREENLET_PY311 0
 #endif
 
+#if GREENLET_PY37 && PY_VERSION_HEX < 0x30C0000
+/*
+Where the interpreter leaves the callable and ``self`` of a call
+relative to its arguments on the frame's value stack, which
+``caller_frame_reference()`` relies on. Checked against 3.7 through
+3.11; later versions need to be checked again before enabling this.
+*/
+#    define GREENLET_CHECK_CALLER_STACK 1
+#else
+#    define GREENLET_CHECK_CALLER_STACK 0
+#endif
+
 #ifndef Py_SET_REFCNT
 /* Py_REFCNT and Py_SIZE macros are converted to functions
 https://bugs.python.org/issue39573 */
 #    define Py_SET_REFCNT(obj, refcnt) Py_REFCNT(obj) = (refcnt)
 #endif
 
+#ifndef Py_SET_TYPE
+#    define Py_SET_TYPE(obj, type) Py_TYPE(obj) = (type)
+#endif
+
 #ifndef _Py_DEC_REFTOTAL
 /* _Py_DEC_REFTOTAL macro has been removed from Python 3.9 by:
   https://github.com/python/cpython/commit/49932fec62c616ec88da52642339d83ae719e924
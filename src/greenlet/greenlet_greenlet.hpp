@@ -11,6 +11,25 @@
 #include "greenlet_refs.hpp"
 #include "greenlet_cpython_compat.hpp"
 #include "greenlet_allocator.hpp"
+#include "greenlet_compression.hpp"
+
+#include <cstdio>
+#include <ctime>
+#include <map>
+
+#ifndef _WIN32
+#  include <sys/mman.h>
+#  include <unistd.h>
+#  include <pthread.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  include <emmintrin.h>
+#  define GREENLET_BLOCK_COMPARE_SSE2 1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#  include <arm_neon.h>
+#  define GREENLET_BLOCK_COMPARE_NEON 1
+#endif
 
 using greenlet::refs::OwnedObject;
 using greenlet::refs::OwnedGreenlet;
@@ -22,9 +41,6 @@ using greenlet::refs::BorrowedGreenlet;
 #  define _PyInterpreterFrame _interpreter_frame
 #endif
 
-// XXX: TODO: Work to remove all virtual functions
-// for speed of calling and size of objects (no vtable).
-// One pattern is the Curiously Recurring Template
 namespace greenlet
 {
     class ExceptionState
@@ -127,6 +143,43 @@ namespace greenlet
         }
     };
 
+    /**
+     * The root frame data stack chunks of greenlets that finished in
+     * this thread (Python 3.11 and newer), kept to start new
+     * greenlets with, so that each one doesn't have to get one from
+     * the arena allocator and give it back. See
+     * PythonState::did_finish(). Empty on older versions.
+     */
+    class FrameChunkCache
+    {
+    private:
+        G_NO_COPIES_OF_CLS(FrameChunkCache);
+#if GREENLET_PY311
+        static const unsigned MAX_CHUNKS = 8;
+        _PyStackChunk* chunks[MAX_CHUNKS];
+        unsigned count;
+        size_t _cached_bytes;
+#endif
+    public:
+        FrameChunkCache();
+        ~FrameChunkCache();
+#if GREENLET_PY311
+        /**
+         * Return a root chunk, or null if we have none.
+         */
+        inline _PyStackChunk* get() G_NOEXCEPT;
+        /**
+         * Keep *chunk*, which must be a root chunk with no frames in
+         * use. Returns false if we're full.
+         */
+        inline bool put(_PyStackChunk* chunk) G_NOEXCEPT;
+#endif
+        /**
+         * Free all the cached chunks, returning how many bytes that was.
+         */
+        size_t trim() G_NOEXCEPT;
+    };
+
     class PythonState : public PythonStateContext<G_IS_PY37>
     {
     public:
@@ -165,12 +218,259 @@ namespace greenlet
 
         int tp_traverse(visitproc visit, void* arg, bool visit_top_frame) G_NOEXCEPT;
         void tp_clear(bool own_top_frame) G_NOEXCEPT;
-        void set_initial_state(const PyThreadState* const tstate) G_NOEXCEPT;
+        // Start with a root frame chunk from *chunks*, if it has one.
+        void set_initial_state(const PyThreadState* const tstate,
+                               FrameChunkCache& chunks) G_NOEXCEPT;
 #if GREENLET_USE_CFRAME
         void set_new_cframe(_PyCFrame& frame) G_NOEXCEPT;
 #endif
         void will_switch_from(PyThreadState *const origin_tstate) G_NOEXCEPT;
-        void did_finish(PyThreadState* tstate) G_NOEXCEPT;
+        // Given *chunks*, the root frame chunk goes there if it has
+        // room.
+        void did_finish(PyThreadState* tstate,
+                        FrameChunkCache* chunks=nullptr) G_NOEXCEPT;
+        // While suspended, is the frame object of any of our frames
+        // referenced by something other than its frame? On 3.11,
+        // such a frame object points into our frame chunks, so we
+        // can't simply throw those away. Always false on older
+        // versions, where frames are ordinary objects.
+        bool frame_objects_referenced() const G_NOEXCEPT;
+    };
+
+    class StackState;
+
+    /**
+     * A contiguous piece of C stack that greenlets take turns
+     * occupying.
+     *
+     * Each thread's native stack is one region; it has no upper
+     * bound we know of. Greenlets created with a ``stack_size`` get
+     * a region of their own, mapped from the OS with a guard page at
+     * the low end. Greenlets started while running in a region share
+     * it with their creator, and their stacks are saved and restored
+     * the classic way; greenlets in different regions never overlap, so
+     * switching between them copies nothing.
+     *
+     * Regions are reference counted by the StackState objects that
+     * live in them. Like the rest of the greenlet state, that count is
+     * protected by the GIL.
+     */
+    class StackRegion
+    {
+    private:
+        G_NO_COPIES_OF_CLS(StackRegion);
+        char* mapping;
+        size_t mapping_size;
+        Py_ssize_t refcount;
+        StackRegion(char* mapping, size_t mapping_size);
+        ~StackRegion();
+    public:
+        /**
+         * The StackState that owns the innermost (lowest) part of
+         * the region that's still in use, i.e., the start of the
+         * chain of ``stack_prev`` pointers. Kept up to date on each
+         * switch.
+         */
+        StackState* head;
+
+        static void* operator new(size_t UNUSED(count));
+        static void operator delete(void* ptr);
+
+        /**
+         * Create a new region describing the running thread's native stack.
+         */
+        static StackRegion* for_native_stack();
+        /**
+         * Map a new region of at least *size* bytes (rounded up to
+         * the page size). Raises MemoryError on failure.
+         */
+        static StackRegion* allocate(size_t size);
+        static size_t page_size() G_NOEXCEPT;
+
+        inline char* top() const G_NOEXCEPT;
+        inline bool native() const G_NOEXCEPT;
+        inline size_t size() const G_NOEXCEPT;
+        inline void incref() G_NOEXCEPT;
+        inline void decref() G_NOEXCEPT;
+    };
+
+    /**
+     * A temporary file that saved stack copies can be moved to when
+     * they take too much memory. Each copy is mapped from its own
+     * range of the file, so it's still read and written like memory,
+     * but the kernel can write it out and drop the pages when it
+     * needs to. Ranges are removed from the file when unmapped and
+     * handed out again; the file is truncated when its end is free.
+     * A copy is never written after it's spilled (see
+     * StackState::copy_stack_to_heap_up_to()).
+     *
+     * A child made by ``fork()`` shares the file and our mappings of
+     * it. So that neither process needs to copy anything, ranges
+     * mapped before the most recent fork are left alone when
+     * unmapped: they're neither removed from the file nor reused,
+     * since the other process may still read them. The child spills
+     * to a new file of its own.
+     *
+     * Shared by all threads; protected by the GIL.
+     */
+    class SpillFile
+    {
+    private:
+        // Returned by take_range() when the file can't grow.
+        static const size_t NO_RANGE = (size_t)-1;
+        // Mapped address -> (file offset, ``forks`` when mapped).
+        typedef std::map<char*, std::pair<size_t, unsigned long> > mappings_t;
+        // File offset -> length, of unused ranges below ``end``.
+        typedef std::map<size_t, size_t> free_ranges_t;
+
+        static FILE* file;
+        static size_t end;
+        static mappings_t mappings;
+        static free_ranges_t free_ranges;
+        // How many times this process, or the one it was forked
+        // from, has forked since loading us.
+        static unsigned long forks;
+        // Whether ``file`` belongs to the process we were forked from.
+        static bool file_inherited;
+
+        static size_t take_range(const size_t length) G_NOEXCEPT;
+        static void release_range(size_t offset, size_t length) G_NOEXCEPT;
+        // The fork handlers only record the fork, so they can't fail
+        // and cost nothing when the child goes on to exec.
+        static void after_fork_in_parent() G_NOEXCEPT;
+        static void after_fork_in_child() G_NOEXCEPT;
+    public:
+        /**
+         * Map *length* (a multiple of the page size) new bytes, or
+         * return NULL if that's not possible.
+         */
+        static char* map(const size_t length) G_NOEXCEPT;
+        static void unmap(char* const mapping, const size_t length) G_NOEXCEPT;
+    };
+
+    /**
+     * A per-thread cache of the buffers that hold saved stack copies.
+     *
+     * Greenlets constantly save their stack when they're switched
+     * away from, and free that copy as soon as they're switched back
+     * to. Instead of going to the allocator each time, buffers are
+     * kept here in power-of-two size classes for the next greenlet
+     * to use. Buffers too big for the largest class aren't cached, and
+     * the total amount cached is capped.
+     *
+     * It also keeps the list of the thread's stack states that hold
+     * an (uncompressed) copy, oldest first, so that copies that
+     * have sat unused long enough can be compressed.
+     *
+     * Only used from the thread that owns it, holding the GIL.
+     * Buffers are plain ``PyMem_Malloc`` blocks, so anything can free
+     * them with ``PyMem_Free`` if the pool isn't at hand.
+     */
+    class StackCopyPool
+    {
+    private:
+        friend class StackState;
+        G_NO_COPIES_OF_CLS(StackCopyPool);
+        // 512 bytes through 1MB.
+        static const unsigned MIN_CLASS = 9;
+        static const unsigned MAX_CLASS = 20;
+        static const size_t MAX_POOLED_BYTES = 4 * 1024 * 1024;
+        // A doubly linked list threaded through stack states.
+        struct StateList
+        {
+            StackState* oldest;
+            StackState* newest;
+        };
+        // The members every switch uses come first. Our ThreadState
+        // puts them in the same cache lines as the current greenlet.
+        // States holding an uncompressed saved copy, oldest first.
+        StateList saved_list;
+        size_t last_compaction;
+    public:
+        // Statistics about saving stacks in this thread.
+        // Switches between greenlets running on the same C stack,
+        // and between greenlets on different stacks (dedicated
+        // stacks or stack groups), which never need to copy anything.
+        size_t switches_within_stack;
+        size_t switches_across_stacks;
+        // Bytes copied from the stack to the heap.
+        size_t bytes_saved;
+        // Bytes that didn't need to be copied because a retained copy
+        // already had them.
+        size_t bytes_skipped;
+    private:
+        // States holding only a retained copy.
+        StateList retained_list;
+        // Free buffers in each class, linked through their first word.
+        char* free_lists[MAX_CLASS - MIN_CLASS + 1];
+        size_t _pooled_bytes;
+        static inline unsigned size_class(const size_t capacity) G_NOEXCEPT;
+    public:
+        // Bytes of stack compressed, what they compressed to, and
+        // the clock ticks spent compressing and decompressing.
+        size_t bytes_compressed;
+        size_t bytes_compressed_to;
+        std::clock_t clocks_compressing;
+        // Bytes of stack moved to the SpillFile.
+        size_t bytes_spilled;
+        // Times a stack copy had to be moved to a bigger buffer.
+        size_t buffers_grown;
+        // Bytes given back by compact().
+        size_t bytes_compacted;
+
+        StackCopyPool();
+        ~StackCopyPool();
+        /**
+         * The capacity of the buffer we'll hand out for a
+         * request of *size* bytes.
+         */
+        static inline size_t capacity_for(const size_t size) G_NOEXCEPT;
+        /**
+         * The largest buffer we keep for reuse.
+         */
+        static inline size_t max_pooled_capacity() G_NOEXCEPT
+        {
+            return (size_t)1 << MAX_CLASS;
+        }
+        /**
+         * Return a buffer of *capacity* (which must come from
+         * capacity_for()) bytes, or NULL if memory is exhausted.
+         */
+        inline char* get(const size_t capacity) G_NOEXCEPT;
+        inline void put(char* const buffer, const size_t capacity) G_NOEXCEPT;
+        /**
+         * Free all the cached buffers, returning how many bytes that was.
+         */
+        size_t trim() G_NOEXCEPT;
+        inline size_t pooled_bytes() const G_NOEXCEPT
+        {
+            return this->_pooled_bytes;
+        }
+        inline size_t switches() const G_NOEXCEPT
+        {
+            return this->switches_within_stack + this->switches_across_stacks;
+        }
+        /**
+         * If compression is enabled and the oldest saved copy has
+         * gone unused for long enough, compress it. Does at most one
+         * copy at a time.
+         */
+        inline void compress_idle() G_NOEXCEPT;
+        /**
+         * While saved copies take more memory than allowed, move the
+         * oldest of this thread's to the SpillFile.
+         */
+        inline void spill_over_limit() G_NOEXCEPT;
+        /**
+         * Give back the memory this thread's stack copies don't need:
+         * drop retained copies, shrink saved copies to fit, and
+         * trim the cache. Returns the number of bytes reclaimed.
+         */
+        size_t compact() G_NOEXCEPT;
+        /**
+         * Called after each switch to apply the policies above.
+         */
+        inline void did_switch() G_NOEXCEPT;
     };
 
     class StackState
@@ -183,20 +483,100 @@ namespace greenlet
         // std::shared_ptr for reference counting just to keep this
         // object small)
     private:
+        friend class StackCopyPool;
+        // The members every switch uses come first, filling a
+        // cache line; the default constructor checks that with
+        // G_LAYOUT_ASSERT (as the constructors of StackCopyPool,
+        // Greenlet and ThreadState do for theirs).
         char* _stack_start;
         char* stack_stop;
         char* stack_copy;
         intptr_t _stack_saved;
         StackState* stack_prev;
-        inline int copy_stack_to_heap_up_to(const char* const stop) G_NOEXCEPT;
+        StackRegion* region;
+        size_t stack_copy_capacity;
+        // If not 0, ``stack_copy`` holds this many bytes of
+        // compressed data, which expand to ``_stack_saved`` bytes.
+        size_t stack_copy_compressed;
+        // When we keep ``stack_copy`` after restoring it (see
+        // ``retain_copies``), the number of bytes in it, and the
+        // stack address they were copied from.
+        intptr_t stack_copy_retained;
+        char* stack_copy_retained_start;
+        // Whether ``stack_copy`` is mapped from the SpillFile.
+        bool stack_copy_mapped;
+        // How big we expect ``stack_copy`` to get, so we can
+        // allocate it at that size to begin with, and the most we've
+        // actually saved.
+        size_t stack_copy_hint;
+        intptr_t _stack_saved_max;
+        // Our place in one of the pool's lists, and the pool's
+        // switch count when we were put there.
+        StackCopyPool::StateList* listed_in;
+        StackState* list_older;
+        StackState* list_newer;
+        size_t saved_at;
+        inline int copy_stack_to_heap_up_to(const char* const stop,
+                                            StackCopyPool& pool) G_NOEXCEPT;
+        /**
+         * Replace ``stack_copy``, releasing the old buffer (to the
+         * *pool*, if given and it came from there).
+         */
+        inline void set_stack_copy(char* const c,
+                                   const size_t capacity,
+                                   const size_t compressed,
+                                   const bool mapped,
+                                   StackCopyPool* const pool) G_NOEXCEPT;
         inline void free_stack_copy() G_NOEXCEPT;
+        inline void return_stack_copy(StackCopyPool& pool) G_NOEXCEPT;
+        inline bool spill_stack_copy(StackCopyPool& pool) G_NOEXCEPT;
+        inline void link(StackCopyPool::StateList& list, const size_t now) G_NOEXCEPT;
+        inline void unlink() G_NOEXCEPT;
+        inline size_t shrink_stack_copy() G_NOEXCEPT;
+        inline void compress_stack_copy(StackCopyPool& pool) G_NOEXCEPT;
+        inline int decompress_stack_copy(StackCopyPool& pool) G_NOEXCEPT;
+        inline void decompress_to(char* const dest, StackCopyPool& pool) const G_NOEXCEPT;
+        static inline intptr_t copy_changed_blocks(char* dest,
+                                                   const char* src,
+                                                   intptr_t size) G_NOEXCEPT;
 
     public:
+        /**
+         * If true, keep the heap copy of a stack after restoring it,
+         * and when saving the stack again, only write the blocks of
+         * it that changed. This helps greenlets that resume, do very
+         * little, and suspend again at the same depth.
+         */
+        static bool retain_copies;
+        /**
+         * If not 0, compress the copy of a suspended greenlet's stack
+         * once this many switches have happened in its thread without
+         * it being resumed.
+         */
+        static size_t compress_after_switches;
+        /**
+         * The number of bytes of saved stack copies held in memory,
+         * by all threads, and if not 0, the most we'd like there to
+         * be. Above that, threads move their coldest copies to the
+         * SpillFile after switching.
+         */
+        static size_t bytes_in_memory;
+        static size_t bytes_in_memory_limit;
+        /**
+         * If not 0, each thread compacts its stack copies after this
+         * many switches.
+         */
+        static size_t compaction_interval;
         /**
          * Creates a started, but inactive, state, using *current*
-         * as the previous.
+         * as the previous. It lives in the same region as *current*.
          */
         StackState(void* mark, StackState& current);
+        /**
+         * Creates a started, but inactive, state that begins at the
+         * top of the (empty) *region*.
+         */
+        explicit StackState(StackRegion& region);
         /**
          * Creates an inactive, unstarted, state.
          */
@@ -204,8 +584,10 @@ namespace greenlet
         ~StackState();
         StackState(const StackState& other);
         StackState& operator=(const StackState& other);
-        inline void copy_heap_to_stack(const StackState& current) G_NOEXCEPT;
-        inline int copy_stack_to_heap(char* const stackref, const StackState& current) G_NOEXCEPT;
+        inline void copy_heap_to_stack(StackCopyPool& pool) G_NOEXCEPT;
+        inline int copy_stack_to_heap(char* const stackref,
+                                      StackState& current,
+                                      StackCopyPool& pool) G_NOEXCEPT;
         inline bool started() const G_NOEXCEPT;
         inline bool main() const G_NOEXCEPT;
         inline bool active() const G_NOEXCEPT;
@@ -213,7 +595,35 @@ namespace greenlet
         inline void set_inactive() G_NOEXCEPT;
         inline intptr_t stack_saved() const G_NOEXCEPT;
         inline char* stack_start() const G_NOEXCEPT;
-        static inline StackState make_main() G_NOEXCEPT;
+        /**
+         * The largest ``stack_saved()`` has been.
+         */
+        inline intptr_t stack_saved_max() const G_NOEXCEPT;
+        /**
+         * Allocate the heap copy to hold at least *size* bytes when
+         * the stack is first saved.
+         */
+        inline void set_stack_copy_hint(const size_t size) G_NOEXCEPT;
+        /**
+         * Is this the first (outermost) user of its own region? Such
+         * a state, if not yet active, can't be started by continuing
+         * on the current stack, it has to begin at ``stack_stop``.
+         */
+        inline bool owns_region() const G_NOEXCEPT;
+        inline char* region_top() const G_NOEXCEPT;
+        /**
+         * Drop our reference to the region. Called once we're finished
+         * with it so that a dedicated stack can be unmapped promptly.
+         */
+        inline void release_region() G_NOEXCEPT;
+        /**
+         * Take ourself out of the chain of states sharing our region
+         * while we're suspended, so that the part of the stack we
+         * still have there can be reused without being saved. Used
+         * when a suspended greenlet is thrown away.
+         */
+        inline void leave_region_chain(StackState& current) G_NOEXCEPT;
+        static inline StackState make_main();
 #ifdef GREENLET_USE_STDIO
         friend std::ostream& operator<<(std::ostream& os, const StackState& s);
 #endif
@@ -230,19 +640,43 @@ namespace greenlet
         // switch. PyErr_... must have been called already.
         OwnedObject _args;
         OwnedObject _kwargs;
+        // If true, _args is the one and only argument, not a tuple
+        // of them, and there are no kwargs.
+        bool _single;
     public:
 
         SwitchingArgs()
+            : _single(false)
         {}
 
         SwitchingArgs(const OwnedObject& args, const OwnedObject& kwargs)
             : _args(args),
-              _kwargs(kwargs)
+              _kwargs(kwargs),
+              _single(false)
+        {}
+
+#if G_HAS_MOVE_SEMANTICS
+        SwitchingArgs(OwnedObject&& args, OwnedObject&& kwargs)
+            : _args(std::move(args)),
+              _kwargs(std::move(kwargs)),
+              _single(false)
+        {}
+#endif
+
+        /**
+         * A switch passing just *value*. This is by far the most
+         * common kind, and we don't need to pack it into a tuple
+         * only to unpack it again on the other side.
+         */
+        explicit SwitchingArgs(const refs::BorrowedObject value)
+            : _args(OwnedObject::owning(value.borrow())),
+              _single(true)
         {}
 
         SwitchingArgs(const SwitchingArgs& other)
             : _args(other._args),
-              _kwargs(other._kwargs)
+              _kwargs(other._kwargs),
+              _single(other._single)
         {}
 
         OwnedObject& args()
@@ -250,6 +684,14 @@ namespace greenlet
             return this->_args;
         }
 
+        /**
+         * If true, args() is the single argument, not a tuple.
+         */
+        bool single() const G_NOEXCEPT
+        {
+            return this->_single;
+        }
+
         OwnedObject& kwargs()
         {
             return this->_kwargs;
@@ -261,8 +703,9 @@ namespace greenlet
         SwitchingArgs& operator<<=(SwitchingArgs& other)
         {
             if (this != &other) {
-                this->_args = other._args;
-                this->_kwargs = other._kwargs;
+                this->_args = G_MOVE(other._args);
+                this->_kwargs = G_MOVE(other._kwargs);
+                this->_single = other._single;
                 other.CLEAR();
             }
             return *this;
@@ -275,6 +718,7 @@ namespace greenlet
         {
             this->_args = OwnedObject::consuming(args);
             this->_kwargs.CLEAR();
+            this->_single = false;
             return *this;
         }
 
@@ -286,8 +730,9 @@ namespace greenlet
         SwitchingArgs& operator<<=(OwnedObject& args)
         {
             assert(&args != &this->_args);
-            this->_args = args;
+            this->_args = G_MOVE(args);
             this->_kwargs.CLEAR();
+            this->_single = false;
             args.CLEAR();
 
             return *this;
@@ -302,6 +747,7 @@ namespace greenlet
         {
             this->_args.CLEAR();
             this->_kwargs.CLEAR();
+            this->_single = false;
         }
     };
 
@@ -320,14 +766,66 @@ namespace greenlet
         friend class UserGreenlet;
         friend class MainGreenlet;
     protected:
-        ExceptionState exception_state;
+        // Whether this is a MainGreenlet or a UserGreenlet. There are
+        // no virtual functions; the functions that differ between
+        // the two check this and call the subclass directly (see the
+        // end of this file).
+        const bool _main_kind;
+        // Whether to discard our stack instead of killing us with
+        // GreenletExit when we're deallocated while suspended; see
+        // abandon().
+        bool _abandon_on_dealloc;
+        // What a switch saves and restores follows, ending with the
+        // start of the stack state; see Greenlet::Greenlet().
         SwitchingArgs switch_args;
-        StackState stack_state;
+        ExceptionState exception_state;
         PythonState python_state;
+        StackState stack_state;
+    private:
+        // While another thread has asked the thread we belong to to
+        // delete us, the next greenlet in that thread's list; see
+        // ThreadState::delete_when_thread_running().
+        PyGreenlet* _next_pending_delete;
+        // While we're suspended in a ``switch()`` into our main
+        // greenlet, called from a Python frame that keeps its own
+        // reference to the main greenlet, or to a bound ``switch``
+        // method of it, until the call returns: that object; see
+        // green_switch_with(). If our stack is thrown away instead,
+        // deactivate_and_free() drops that reference, which nothing
+        // else could find.
+        PyObject* _held_by_frame;
+    protected:
+        // Only a MainGreenlet starts with a stack.
         Greenlet(PyGreenlet* p, const StackState& initial_state);
     public:
         Greenlet(PyGreenlet* p);
-        virtual ~Greenlet();
+        // Not virtual: use destroy().
+        ~Greenlet();
+
+        /**
+         * Run the destructor of the subclass. The memory isn't
+         * freed.
+         */
+        inline void destroy();
+
+        /**
+         * True if this is a MainGreenlet. Unlike main(), this stays
+         * true after the thread exits.
+         */
+        inline bool main_kind() const G_NOEXCEPT
+        {
+            return this->_main_kind;
+        }
+
+        inline bool abandon_on_dealloc() const G_NOEXCEPT
+        {
+            return this->_abandon_on_dealloc;
+        }
+
+        inline void abandon_on_dealloc(const bool flag) G_NOEXCEPT
+        {
+            this->_abandon_on_dealloc = flag;
+        }
 
         template <typename IsPy37> // maybe we can use a value here?
         const OwnedObject context(const typename IsPy37::IsIt=nullptr) const;
@@ -340,7 +838,7 @@ namespace greenlet
             return this->switch_args;
         }
 
-        virtual const refs::BorrowedMainGreenlet main_greenlet() const = 0;
+        inline const refs::BorrowedMainGreenlet main_greenlet() const;
 
         inline intptr_t stack_saved() const G_NOEXCEPT
         {
@@ -357,15 +855,18 @@ namespace greenlet
             return this->stack_state.stack_start();
         }
 
-        virtual OwnedObject throw_GreenletExit_during_dealloc(const ThreadState& current_thread_state);
-        virtual OwnedObject g_switch() = 0;
+        inline OwnedObject throw_GreenletExit_during_dealloc(const ThreadState& current_thread_state);
+        // Switch to this greenlet (or the first live one in its
+        // parent chain) from the current greenlet of
+        // *current_thread_state*, which must be the running thread's.
+        inline OwnedObject g_switch(ThreadState& current_thread_state);
         /**
          * Force the greenlet to appear dead. Used when it's not
          * possible to throw an exception into a greenlet anymore.
          *
          * This losses access to the thread state and the main greenlet.
          */
-        virtual void murder_in_place();
+        inline void murder_in_place();
 
         /**
          * Called when somebody notices we were running in a dead
@@ -376,6 +877,27 @@ namespace greenlet
          */
         inline void deactivate_and_free();
 
+        /**
+         * Throw away a suspended greenlet of the running thread
+         * without switching into it: like ``deactivate_and_free()``,
+         * but the part of its stack that's still in use is given
+         * back. Nothing it was doing gets to finish; ``finally``
+         * blocks and context managers don't run, and objects that
+         * only its C stack referred to are never released.
+         */
+        void abandon(const ThreadState& current_thread_state);
+
+        /**
+         * Record that a frame of ours is about to switch into our
+         * main greenlet while holding a reference to *held* (the main
+         * greenlet or its bound ``switch``), or (given null) that
+         * the switch returned.
+         */
+        inline void held_by_frame(PyObject* held) G_NOEXCEPT
+        {
+            this->_held_by_frame = held;
+        }
+
 
         // Called when some thread wants to deallocate a greenlet
         // object.
@@ -390,7 +912,7 @@ namespace greenlet
         inline int slp_save_state(char *const stackref) G_NOEXCEPT;
 
         inline bool is_currently_running_in_some_thread() const;
-        virtual bool belongs_to_thread(const ThreadState* state) const;
+        inline bool belongs_to_thread(const ThreadState* state) const;
 
         inline bool started() const
         {
@@ -404,46 +926,50 @@ namespace greenlet
         {
             return this->stack_state.main();
         }
-        virtual refs::BorrowedMainGreenlet find_main_greenlet_in_lineage() const = 0;
+        inline refs::BorrowedMainGreenlet find_main_greenlet_in_lineage() const;
 
-        virtual const OwnedGreenlet parent() const = 0;
-        virtual void parent(const refs::BorrowedObject new_parent) = 0;
+        inline const OwnedGreenlet parent() const;
+        inline void parent(const refs::BorrowedObject new_parent);
 
         inline const PythonState::OwnedFrame& top_frame()
         {
             return this->python_state.top_frame();
         }
 
-        virtual const OwnedObject& run() const = 0;
-        virtual void run(const refs::BorrowedObject nrun) = 0;
+        inline const OwnedObject& run() const;
+        inline void run(const refs::BorrowedObject nrun);
 
 
-        virtual int tp_traverse(visitproc visit, void* arg);
-        virtual int tp_clear();
+        inline int tp_traverse(visitproc visit, void* arg);
+        inline int tp_clear();
 
 
         // Return the thread state that the greenlet is running in, or
         // null if the greenlet is not running or the thread is known
         // to have exited.
-        virtual ThreadState* thread_state() const G_NOEXCEPT = 0;
+        inline ThreadState* thread_state() const G_NOEXCEPT;
 
         // Return true if the greenlet is known to have been running
         // (active) in a thread that has now exited.
-        virtual bool was_running_in_dead_thread() const G_NOEXCEPT = 0;
+        inline bool was_running_in_dead_thread() const G_NOEXCEPT;
 
         // Return a borrowed greenlet that is the Python object
         // this object represents.
-        virtual BorrowedGreenlet self() const G_NOEXCEPT = 0;
+        inline BorrowedGreenlet self() const G_NOEXCEPT;
 
     protected:
         inline void release_args();
 
-        // The functions that must not be inlined are declared virtual.
-        // We also mark them as protected, not private, so that the
-        // compiler is forced to call them through a function pointer.
-        // (A sufficiently smart compiler could directly call a private
-        // virtual function since it can never be overridden in a
-        // subclass).
+        // The parts of the functions above shared by both kinds of
+        // greenlet.
+        OwnedObject _throw_GreenletExit_during_dealloc(const ThreadState& current_thread_state);
+        void _murder_in_place();
+        bool _belongs_to_thread(const ThreadState* state) const;
+        int _tp_traverse(visitproc visit, void* arg);
+        int _tp_clear();
+
+        // The functions that must not be inlined are declared
+        // GREENLET_NOINLINE.
 
         // Also TODO: Switch away from integer error codes and to enums,
         // or throw exceptions when possible.
@@ -487,13 +1013,14 @@ namespace greenlet
         };
 
         // Returns the previous greenlet we just switched away from.
-        virtual OwnedGreenlet g_switchstack_success() G_NOEXCEPT;
+        OwnedGreenlet GREENLET_NOINLINE(g_switchstack_success)() G_NOEXCEPT;
 
 
-        // Check the preconditions for switching to this greenlet; if they
-        // aren't met, throws PyErrOccurred. Most callers will want to
-        // catch this and clear the arguments
-        inline void check_switch_allowed() const;
+        // Check the preconditions for switching to this greenlet from
+        // the thread of *current_thread_state*; if they aren't met,
+        // throws PyErrOccurred. Most callers will want to catch this
+        // and clear the arguments
+        inline void check_switch_allowed(const ThreadState& current_thread_state) const;
         class GreenletStartedWhileInPython : public std::runtime_error
         {
         public:
@@ -536,7 +1063,7 @@ namespace greenlet
            should no longer be the case with thread-local variables.)
 
         */
-        switchstack_result_t g_switchstack(void);
+        switchstack_result_t g_switchstack(ThreadState& thread_state);
     private:
         OwnedObject g_switch_finish(const switchstack_result_t& err);
 
@@ -550,36 +1077,58 @@ namespace greenlet
         OwnedMainGreenlet _main_greenlet;
         OwnedObject _run_callable;
         OwnedGreenlet _parent;
+        // Until we start, the main greenlet of our parent if it has
+        // one, which it can't change, so that checking whether we
+        // can be switched to needn't follow the parent chain. If our
+        // parent hasn't started either, this is null.
+        OwnedMainGreenlet _main_greenlet_of_parent;
+        // If not 0, the size of the dedicated stack we get when
+        // started.
+        size_t _stack_size;
+        // If not negative, we start on our thread's shared stack for
+        // this group instead.
+        Py_ssize_t _stack_group;
     public:
         static void* operator new(size_t UNUSED(count));
         static void operator delete(void* ptr);
 
         UserGreenlet(PyGreenlet* p, BorrowedGreenlet the_parent);
-        virtual ~UserGreenlet();
+        ~UserGreenlet();
 
-        virtual refs::BorrowedMainGreenlet find_main_greenlet_in_lineage() const;
-        virtual bool was_running_in_dead_thread() const G_NOEXCEPT;
-        virtual ThreadState* thread_state() const G_NOEXCEPT;
-        virtual OwnedObject g_switch();
-        virtual const OwnedObject& run() const
+        refs::BorrowedMainGreenlet find_main_greenlet_in_lineage() const;
+        inline bool was_running_in_dead_thread() const G_NOEXCEPT;
+        inline ThreadState* thread_state() const G_NOEXCEPT;
+        OwnedObject g_switch(ThreadState& current_thread_state);
+        const OwnedObject& run() const
         {
             if (this->started() || !this->_run_callable) {
                 throw AttributeError("run");
             }
             return this->_run_callable;
         }
-        virtual void run(const refs::BorrowedObject nrun);
+        void run(const refs::BorrowedObject nrun);
 
-        virtual const OwnedGreenlet parent() const;
-        virtual void parent(const refs::BorrowedObject new_parent);
+        const OwnedGreenlet parent() const;
+        void parent(const refs::BorrowedObject new_parent);
+
+        inline size_t stack_size() const G_NOEXCEPT
+        {
+            return this->_stack_size;
+        }
+        void stack_size(const size_t size);
+        inline Py_ssize_t stack_group() const G_NOEXCEPT
+        {
+            return this->_stack_group;
+        }
+        void stack_group(const Py_ssize_t group);
 
-        virtual const refs::BorrowedMainGreenlet main_greenlet() const;
+        inline const refs::BorrowedMainGreenlet main_greenlet() const;
 
-        virtual BorrowedGreenlet self() const G_NOEXCEPT;
-        virtual void murder_in_place();
-        virtual bool belongs_to_thread(const ThreadState* state) const;
-        virtual int tp_traverse(visitproc visit, void* arg);
-        virtual int tp_clear();
+        inline BorrowedGreenlet self() const G_NOEXCEPT;
+        void murder_in_place();
+        bool belongs_to_thread(const ThreadState* state) const;
+        int tp_traverse(visitproc visit, void* arg);
+        int tp_clear();
         class ParentIsCurrentGuard
         {
         private:
@@ -590,43 +1139,45 @@ namespace greenlet
             ParentIsCurrentGuard(UserGreenlet* p, const ThreadState& thread_state);
             ~ParentIsCurrentGuard();
         };
-        virtual OwnedObject throw_GreenletExit_during_dealloc(const ThreadState& current_thread_state);
+        OwnedObject throw_GreenletExit_during_dealloc(const ThreadState& current_thread_state);
     protected:
-        virtual switchstack_result_t g_initialstub(void* mark);
+        switchstack_result_t GREENLET_NOINLINE(g_initialstub)(void* mark, ThreadState& thread_state);
     private:
         void inner_bootstrap(OwnedGreenlet& origin_greenlet, OwnedObject& run) G_NOEXCEPT_WIN32;
+    public:
+        // Called on a fresh dedicated stack in place of
+        // returning from the switch in g_initialstub(). Never returns.
+        void bootstrap_on_own_stack() G_NOEXCEPT_WIN32;
     };
 
     class MainGreenlet : public Greenlet
     {
     private:
-        static greenlet::PythonAllocator<MainGreenlet> allocator;
         refs::BorrowedMainGreenlet _self;
         ThreadState* _thread_state;
         G_NO_COPIES_OF_CLS(MainGreenlet);
     public:
-        static void* operator new(size_t UNUSED(count));
-        static void operator delete(void* ptr);
-
+        // Always constructed inside its greenlet object; see
+        // green_alloc_with_impl().
         MainGreenlet(refs::BorrowedMainGreenlet::PyType*, ThreadState*);
-        virtual ~MainGreenlet();
+        ~MainGreenlet();
 
 
-        virtual const OwnedObject& run() const;
-        virtual void run(const refs::BorrowedObject nrun);
+        const OwnedObject& run() const;
+        void run(const refs::BorrowedObject nrun);
 
-        virtual const OwnedGreenlet parent() const;
-        virtual void parent(const refs::BorrowedObject new_parent);
+        const OwnedGreenlet parent() const;
+        void parent(const refs::BorrowedObject new_parent);
 
-        virtual const refs::BorrowedMainGreenlet main_greenlet() const;
+        inline const refs::BorrowedMainGreenlet main_greenlet() const;
 
-        virtual refs::BorrowedMainGreenlet find_main_greenlet_in_lineage() const;
-        virtual bool was_running_in_dead_thread() const G_NOEXCEPT;
-        virtual ThreadState* thread_state() const G_NOEXCEPT;
+        inline refs::BorrowedMainGreenlet find_main_greenlet_in_lineage() const;
+        inline bool was_running_in_dead_thread() const G_NOEXCEPT;
+        inline ThreadState* thread_state() const G_NOEXCEPT;
         void thread_state(ThreadState*) G_NOEXCEPT;
-        virtual OwnedObject g_switch();
-        virtual BorrowedGreenlet self() const G_NOEXCEPT;
-        virtual int tp_traverse(visitproc visit, void* arg);
+        OwnedObject g_switch(ThreadState& current_thread_state);
+        inline BorrowedGreenlet self() const G_NOEXCEPT;
+        int tp_traverse(visitproc visit, void* arg);
     };
 
 };
@@ -851,10 +1402,17 @@ void PythonState::operator<<(const PyThreadState *const tstate) G_NOEXCEPT
 void PythonState::operator>>(PyThreadState *const tstate) G_NOEXCEPT
 {
 #if GREENLET_PY37
-    tstate->context = this->_context.relinquish_ownership();
+    PyObject* const context = this->_context.relinquish_ownership();
     /* Incrementing this value invalidates the contextvars cache,
-       which would otherwise remain valid across switches */
-    tstate->context_ver++;
+       which would otherwise remain valid across switches. That's
+       only needed if the context changes: until we store ours, the
+       thread state still has the one the origin greenlet saved, and
+       the cache can only be describing that. Greenlets commonly
+       share a context, or both have none. */
+    if (tstate->context != context) {
+        tstate->context = context;
+        tstate->context_ver++;
+    }
 #endif
 #if GREENLET_USE_CFRAME
     tstate->cframe = this->cframe;
@@ -892,12 +1450,26 @@ void PythonState::will_switch_from(PyThreadState *const origin_tstate) G_NOEXCEP
 #endif
 }
 
-void PythonState::set_initial_state(const PyThreadState* const tstate) G_NOEXCEPT
+void PythonState::set_initial_state(const PyThreadState* const tstate,
+                                    FrameChunkCache& chunks) G_NOEXCEPT
 {
     this->_top_frame = nullptr;
 #if GREENLET_PY311
     this->recursion_depth = tstate->recursion_limit - tstate->recursion_remaining;
+    // Set up the chunk the way the interpreter does when it pushes
+    // the first frame of a thread onto a new root chunk: leaving the
+    // first slot unused means no frame ever starts at the beginning
+    // of the chunk, which is how popping a frame knows not to free
+    // the chunk it's in.
+    _PyStackChunk* const chunk = chunks.get();
+    if (chunk) {
+        this->datastack_chunk = chunk;
+        this->datastack_top = &chunk->data[1];
+        this->datastack_limit = reinterpret_cast<PyObject**>(
+            reinterpret_cast<char*>(chunk) + chunk->size);
+    }
 #else
+    (void)chunks;
     this->recursion_depth = tstate->recursion_depth;
 #endif
 }
@@ -938,12 +1510,46 @@ void PythonState::set_new_cframe(_PyCFrame& frame) G_NOEXCEPT
 }
 #endif
 
+#if GREENLET_PY311
+// From "internal/pycore_frame.h", up to the members we use. As with
+// the structures in greenlet.cpp, we can't count on being able to
+// include the private header.
+typedef struct {
+    PyObject* f_func;
+    PyObject* f_globals;
+    PyObject* f_builtins;
+    PyObject* f_locals;
+    PyCodeObject* f_code;
+    PyFrameObject* frame_obj; // Strong reference; may be NULL.
+    _PyInterpreterFrame* previous;
+    // ...
+} greenlet_InterpreterFrameHead;
+#endif
+
+bool PythonState::frame_objects_referenced() const G_NOEXCEPT
+{
+#if GREENLET_PY311
+    // Our first frame was started with no previous frame, so
+    // following ``previous`` only visits frames of this greenlet
+    // (including those of generators it was running).
+    for (const _PyInterpreterFrame* iframe = this->current_frame; iframe;) {
+        const greenlet_InterpreterFrameHead* const head =
+            reinterpret_cast<const greenlet_InterpreterFrameHead*>(iframe);
+        if (head->frame_obj && Py_REFCNT(head->frame_obj) > 1) {
+            return true;
+        }
+        iframe = head->previous;
+    }
+#endif
+    return false;
+}
+
 const PythonState::OwnedFrame& PythonState::top_frame() const G_NOEXCEPT
 {
     return this->_top_frame;
 }
 
-void PythonState::did_finish(PyThreadState* tstate) G_NOEXCEPT
+void PythonState::did_finish(PyThreadState* tstate, FrameChunkCache* chunks) G_NOEXCEPT
 {
 #if GREENLET_PY311
     // See https://github.com/gevent/gevent/issues/1924 and
@@ -1013,7 +1619,11 @@ void PythonState::did_finish(PyThreadState* tstate) G_NOEXCEPT
         while (chunk) {
             _PyStackChunk *prev = chunk->previous;
             chunk->previous = nullptr;
-            alloc.free(alloc.ctx, chunk, chunk->size);
+            // Having finished, the root chunk (the only one left,
+            // usually) is empty, and can be given to a new greenlet.
+            if (!(chunks && tstate && !prev && chunks->put(chunk))) {
+                alloc.free(alloc.ctx, chunk, chunk->size);
+            }
             chunk = prev;
         }
     }
@@ -1021,118 +1631,881 @@ void PythonState::did_finish(PyThreadState* tstate) G_NOEXCEPT
     this->datastack_chunk = nullptr;
     this->datastack_limit = nullptr;
     this->datastack_top = nullptr;
+#else
+    (void)chunks;
 #endif
 }
 
 
 
 
+using greenlet::StackRegion;
+using greenlet::SpillFile;
+using greenlet::StackCopyPool;
+using greenlet::FrameChunkCache;
 using greenlet::StackState;
 
-#ifdef GREENLET_USE_STDIO
-#include <iostream>
-using std::cerr;
-using std::endl;
-
-std::ostream& greenlet::operator<<(std::ostream& os, const StackState& s)
+FrameChunkCache::FrameChunkCache()
+#if GREENLET_PY311
+    : count(0),
+      _cached_bytes(0)
+#endif
 {
-    os << "StackState(stack_start=" << (void*)s._stack_start
-       << ", stack_stop=" << (void*)s.stack_stop
-       << ", stack_copy=" << (void*)s.stack_copy
-       << ", stack_saved=" << s._stack_saved
-       << ", stack_prev=" << s.stack_prev
-       << ", addr=" << &s
-       << ")";
-    return os;
 }
-#endif
 
-StackState::StackState(void* mark, StackState& current)
-    : _stack_start(nullptr),
-      stack_stop((char*)mark),
-      stack_copy(nullptr),
-      _stack_saved(0),
-      /* Skip a dying greenlet */
-      stack_prev(current._stack_start
-                 ? &current
-                 : current.stack_prev)
+FrameChunkCache::~FrameChunkCache()
 {
+    this->trim();
 }
 
-StackState::StackState()
-    : _stack_start(nullptr),
-      stack_stop(nullptr),
-      stack_copy(nullptr),
-      _stack_saved(0),
-      stack_prev(nullptr)
+#if GREENLET_PY311
+inline _PyStackChunk* FrameChunkCache::get() G_NOEXCEPT
 {
+    if (!this->count) {
+        return nullptr;
+    }
+    _PyStackChunk* const chunk = this->chunks[--this->count];
+    this->_cached_bytes -= chunk->size;
+    return chunk;
 }
 
-StackState::StackState(const StackState& other)
-// can't use a delegating constructor because of
-// MSVC for Python 2.7
-    : _stack_start(nullptr),
-      stack_stop(nullptr),
-      stack_copy(nullptr),
-      _stack_saved(0),
-      stack_prev(nullptr)
+inline bool FrameChunkCache::put(_PyStackChunk* chunk) G_NOEXCEPT
 {
-    this->operator=(other);
+    assert(!chunk->previous);
+    if (this->count == MAX_CHUNKS) {
+        return false;
+    }
+    this->chunks[this->count++] = chunk;
+    this->_cached_bytes += chunk->size;
+    return true;
 }
+#endif
 
-StackState& StackState::operator=(const StackState& other)
+size_t FrameChunkCache::trim() G_NOEXCEPT
 {
-    if (&other == this) {
-        return *this;
-    }
-    if (other._stack_saved) {
-        throw std::runtime_error("Refusing to steal memory.");
+#if GREENLET_PY311
+    const size_t result = this->_cached_bytes;
+    PyObjectArenaAllocator alloc;
+    PyObject_GetArenaAllocator(&alloc);
+    while (this->count) {
+        _PyStackChunk* const chunk = this->chunks[--this->count];
+        if (alloc.free) {
+            alloc.free(alloc.ctx, chunk, chunk->size);
+        }
     }
+    this->_cached_bytes = 0;
+    return result;
+#else
+    return 0;
+#endif
+}
 
-    //If we have memory allocated, dispose of it
-    this->free_stack_copy();
+StackCopyPool::StackCopyPool()
+    : last_compaction(0),
+      switches_within_stack(0),
+      switches_across_stacks(0),
+      bytes_saved(0),
+      bytes_skipped(0),
+      _pooled_bytes(0),
+      bytes_compressed(0),
+      bytes_compressed_to(0),
+      clocks_compressing(0),
+      bytes_spilled(0),
+      buffers_grown(0),
+      bytes_compacted(0)
+{
+    G_LAYOUT_ASSERT(offsetof(StackCopyPool, bytes_skipped) <= 64,
+                    "The members of StackCopyPool used on each switch should fit in a cache line");
+    this->saved_list.oldest = this->saved_list.newest = nullptr;
+    this->retained_list.oldest = this->retained_list.newest = nullptr;
+    for (unsigned i = 0; i <= MAX_CLASS - MIN_CLASS; i++) {
+        this->free_lists[i] = nullptr;
+    }
+}
 
-    this->_stack_start = other._stack_start;
-    this->stack_stop = other.stack_stop;
-    this->stack_copy = other.stack_copy;
-    this->_stack_saved = other._stack_saved;
-    this->stack_prev = other.stack_prev;
-    return *this;
+StackCopyPool::~StackCopyPool()
+{
+    // Greenlets can outlive their thread; don't leave them pointing
+    // at us.
+    while (this->saved_list.oldest) {
+        this->saved_list.oldest->unlink();
+    }
+    while (this->retained_list.oldest) {
+        this->retained_list.oldest->unlink();
+    }
+    this->trim();
 }
 
-inline void StackState::free_stack_copy() G_NOEXCEPT
+inline size_t StackCopyPool::capacity_for(const size_t size) G_NOEXCEPT
 {
-    PyMem_Free(this->stack_copy);
-    this->stack_copy = nullptr;
-    this->_stack_saved = 0;
+    if (size > ((size_t)1 << MAX_CLASS)) {
+        return size;
+    }
+    size_t capacity = (size_t)1 << MIN_CLASS;
+    while (capacity < size) {
+        capacity <<= 1;
+    }
+    return capacity;
 }
 
-inline void StackState::copy_heap_to_stack(const StackState& current) G_NOEXCEPT
+inline unsigned StackCopyPool::size_class(const size_t capacity) G_NOEXCEPT
 {
-    // cerr << "copy_heap_to_stack" << endl
-    //      << "\tFrom    : " << *this << endl
-    //      << "\tCurrent:" << current
-    //      << endl;
-    /* Restore the heap copy back into the C stack */
-    if (this->_stack_saved != 0) {
-        memcpy(this->_stack_start, this->stack_copy, this->_stack_saved);
-        this->free_stack_copy();
+    unsigned klass = MIN_CLASS;
+    while (((size_t)1 << klass) < capacity) {
+        klass++;
     }
-    StackState* owner = const_cast<StackState*>(&current);
-    if (!owner->_stack_start) {
-        owner = owner->stack_prev; /* greenlet is dying, skip it */
+    return klass - MIN_CLASS;
+}
+
+inline char* StackCopyPool::get(const size_t capacity) G_NOEXCEPT
+{
+    if (capacity <= ((size_t)1 << MAX_CLASS)) {
+        char*& head = this->free_lists[size_class(capacity)];
+        if (head) {
+            char* result = head;
+            head = *reinterpret_cast<char**>(result);
+            this->_pooled_bytes -= capacity;
+            return result;
+        }
     }
-    while (owner && owner->stack_stop <= this->stack_stop) {
-        // cerr << "\tOwner: " << owner << endl;
-        owner = owner->stack_prev; /* find greenlet with more stack */
+    return (char*)PyMem_Malloc(capacity);
+}
+
+inline void StackCopyPool::put(char* const buffer, const size_t capacity) G_NOEXCEPT
+{
+    if (capacity > ((size_t)1 << MAX_CLASS)
+        || capacity != capacity_for(capacity)
+        || this->_pooled_bytes + capacity > MAX_POOLED_BYTES) {
+        PyMem_Free(buffer);
+        return;
     }
-    this->stack_prev = owner;
-    // cerr << "\tFinished with: " << *this << endl;
+    char*& head = this->free_lists[size_class(capacity)];
+    *reinterpret_cast<char**>(buffer) = head;
+    head = buffer;
+    this->_pooled_bytes += capacity;
 }
 
-inline int StackState::copy_stack_to_heap_up_to(const char* const stop) G_NOEXCEPT
+size_t StackCopyPool::trim() G_NOEXCEPT
 {
-    /* Save more of g's stack into the heap -- at least up to 'stop'
+    const size_t result = this->_pooled_bytes;
+    for (unsigned i = 0; i <= MAX_CLASS - MIN_CLASS; i++) {
+        char* buffer = this->free_lists[i];
+        while (buffer) {
+            char* next = *reinterpret_cast<char**>(buffer);
+            PyMem_Free(buffer);
+            buffer = next;
+        }
+        this->free_lists[i] = nullptr;
+    }
+    this->_pooled_bytes = 0;
+    return result;
+}
+
+StackRegion::StackRegion(char* mapping, size_t mapping_size)
+    : mapping(mapping),
+      mapping_size(mapping_size),
+      refcount(1),
+      head(nullptr)
+{
+}
+
+StackRegion::~StackRegion()
+{
+#ifndef _WIN32
+    if (this->mapping) {
+        munmap(this->mapping, this->mapping_size);
+    }
+#endif
+}
+
+void* StackRegion::operator new(size_t UNUSED(count))
+{
+    return PyObject_Malloc(sizeof(StackRegion));
+}
+
+void StackRegion::operator delete(void* ptr)
+{
+    PyObject_Free(ptr);
+}
+
+StackRegion* StackRegion::for_native_stack()
+{
+    StackRegion* region = new StackRegion(nullptr, 0);
+    if (!region) {
+        throw PyFatalError("greenlet: failed to allocate the native stack region");
+    }
+    return region;
+}
+
+size_t StackRegion::page_size() G_NOEXCEPT
+{
+#ifndef _WIN32
+    static size_t page = 0;
+    if (!page) {
+        long sz = sysconf(_SC_PAGESIZE);
+        page = sz > 0 ? (size_t)sz : 4096;
+    }
+    return page;
+#else
+    return 4096;
+#endif
+}
+
+StackRegion* StackRegion::allocate(size_t size)
+{
+#ifndef _WIN32
+    const size_t page = StackRegion::page_size();
+    // Round up, and add the guard page.
+    size = ((size + page - 1) / page) * page + page;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#  ifdef MAP_STACK
+    flags |= MAP_STACK;
+#  endif
+    void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (mapping == MAP_FAILED) {
+        PyErr_NoMemory();
+        throw PyErrOccurred();
+    }
+    // Overflowing the stack should crash, not scribble over whatever
+    // happens to be mapped below us.
+    if (mprotect(mapping, page, PROT_NONE) != 0) {
+        munmap(mapping, size);
+        PyErr_SetFromErrno(PyExc_OSError);
+        throw PyErrOccurred();
+    }
+    StackRegion* region = new StackRegion((char*)mapping, size);
+    if (!region) {
+        munmap(mapping, size);
+        PyErr_NoMemory();
+        throw PyErrOccurred();
+    }
+    return region;
+#else
+    (void)size;
+    throw PyErrOccurred(PyExc_NotImplementedError,
+                        "Dedicated greenlet stacks are not supported on this platform");
+#endif
+}
+
+FILE* SpillFile::file = nullptr;
+size_t SpillFile::end = 0;
+SpillFile::mappings_t SpillFile::mappings;
+SpillFile::free_ranges_t SpillFile::free_ranges;
+unsigned long SpillFile::forks = 0;
+bool SpillFile::file_inherited = false;
+
+size_t SpillFile::take_range(const size_t length) G_NOEXCEPT
+{
+    // First fit.
+    for (free_ranges_t::iterator it = SpillFile::free_ranges.begin();
+         it != SpillFile::free_ranges.end(); ++it) {
+        if (it->second >= length) {
+            const size_t offset = it->first;
+            const size_t rest = it->second - length;
+            SpillFile::free_ranges.erase(it);
+            if (rest) {
+                SpillFile::free_ranges[offset + length] = rest;
+            }
+            return offset;
+        }
+    }
+#ifndef _WIN32
+    if (ftruncate(fileno(SpillFile::file), (off_t)(SpillFile::end + length)) != 0) {
+        return NO_RANGE;
+    }
+#endif
+    const size_t offset = SpillFile::end;
+    SpillFile::end += length;
+    return offset;
+}
+
+void SpillFile::release_range(size_t offset, size_t length) G_NOEXCEPT
+{
+    // Merge with the free ranges on either side.
+    free_ranges_t::iterator after = SpillFile::free_ranges.lower_bound(offset);
+    if (after != SpillFile::free_ranges.end() && offset + length == after->first) {
+        length += after->second;
+        SpillFile::free_ranges.erase(after++);
+    }
+    if (after != SpillFile::free_ranges.begin()) {
+        free_ranges_t::iterator before = after;
+        --before;
+        if (before->first + before->second == offset) {
+            offset = before->first;
+            length += before->second;
+            SpillFile::free_ranges.erase(before);
+        }
+    }
+    if (offset + length == SpillFile::end) {
+        SpillFile::end = offset;
+#ifndef _WIN32
+        if (ftruncate(fileno(SpillFile::file), (off_t)offset) != 0) {
+            // The space was already freed by MADV_REMOVE, if we have
+            // it; otherwise, it's reused when the file grows again.
+        }
+#endif
+        return;
+    }
+    SpillFile::free_ranges[offset] = length;
+}
+
+void SpillFile::after_fork_in_parent() G_NOEXCEPT
+{
+    SpillFile::forks++;
+}
+
+void SpillFile::after_fork_in_child() G_NOEXCEPT
+{
+    SpillFile::forks++;
+    if (SpillFile::file) {
+        SpillFile::file_inherited = true;
+    }
+}
+
+char* SpillFile::map(const size_t length) G_NOEXCEPT
+{
+#ifndef _WIN32
+    if (SpillFile::file_inherited) {
+        // Closing our descriptor leaves the parent's file, and our
+        // mappings of it, alone. Its free ranges aren't ours to use.
+        fclose(SpillFile::file);
+        SpillFile::file = nullptr;
+        SpillFile::file_inherited = false;
+        SpillFile::end = 0;
+        SpillFile::free_ranges.clear();
+    }
+    if (!SpillFile::file) {
+        static bool registered_fork_handlers = false;
+        if (!registered_fork_handlers) {
+            if (pthread_atfork(nullptr,
+                               SpillFile::after_fork_in_parent,
+                               SpillFile::after_fork_in_child) != 0) {
+                return nullptr;
+            }
+            registered_fork_handlers = true;
+        }
+        // Already unlinked, so it goes away with the process.
+        SpillFile::file = tmpfile();
+        if (!SpillFile::file) {
+            return nullptr;
+        }
+    }
+    const size_t offset = SpillFile::take_range(length);
+    if (offset == NO_RANGE) {
+        return nullptr;
+    }
+    void* mapping = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         fileno(SpillFile::file), (off_t)offset);
+    if (mapping == MAP_FAILED) {
+        SpillFile::release_range(offset, length);
+        return nullptr;
+    }
+    SpillFile::mappings[(char*)mapping] = std::make_pair(offset, SpillFile::forks);
+    return (char*)mapping;
+#else
+    (void)length;
+    return nullptr;
+#endif
+}
+
+void SpillFile::unmap(char* const mapping, const size_t length) G_NOEXCEPT
+{
+#ifndef _WIN32
+    mappings_t::iterator it = SpillFile::mappings.find(mapping);
+    assert(it != SpillFile::mappings.end());
+    const size_t offset = it->second.first;
+    // Otherwise, another process may still be using the range.
+    const bool ours = it->second.second == SpillFile::forks;
+    SpillFile::mappings.erase(it);
+#  ifdef MADV_REMOVE
+    if (ours) {
+        // Free the space in the file now, instead of writing it out.
+        madvise(mapping, length, MADV_REMOVE);
+    }
+#  endif
+    munmap(mapping, length);
+    if (ours) {
+        SpillFile::release_range(offset, length);
+    }
+#else
+    (void)mapping;
+    (void)length;
+#endif
+}
+
+inline char* StackRegion::top() const G_NOEXCEPT
+{
+    if (!this->mapping) {
+        return (char*)-1;
+    }
+    return this->mapping + this->mapping_size;
+}
+
+inline bool StackRegion::native() const G_NOEXCEPT
+{
+    return this->mapping == nullptr;
+}
+
+inline size_t StackRegion::size() const G_NOEXCEPT
+{
+    // Not counting the guard page.
+    return this->mapping ? this->mapping_size - StackRegion::page_size() : 0;
+}
+
+inline void StackRegion::incref() G_NOEXCEPT
+{
+    this->refcount++;
+}
+
+inline void StackRegion::decref() G_NOEXCEPT
+{
+    assert(this->refcount > 0);
+    if (--this->refcount == 0) {
+        delete this;
+    }
+}
+
+#ifdef GREENLET_USE_STDIO
+#include <iostream>
+using std::cerr;
+using std::endl;
+
+std::ostream& greenlet::operator<<(std::ostream& os, const StackState& s)
+{
+    os << "StackState(stack_start=" << (void*)s._stack_start
+       << ", stack_stop=" << (void*)s.stack_stop
+       << ", stack_copy=" << (void*)s.stack_copy
+       << ", stack_saved=" << s._stack_saved
+       << ", stack_prev=" << s.stack_prev
+       << ", region=" << (void*)s.region
+       << ", addr=" << &s
+       << ")";
+    return os;
+}
+#endif
+
+StackState::StackState(void* mark, StackState& current)
+    : _stack_start(nullptr),
+      stack_stop((char*)mark),
+      stack_copy(nullptr),
+      _stack_saved(0),
+      /* Skip a dying greenlet */
+      stack_prev(current._stack_start
+                 ? &current
+                 : current.stack_prev),
+      region(current.region),
+      stack_copy_capacity(0),
+      stack_copy_compressed(0),
+      stack_copy_retained(0),
+      stack_copy_retained_start(nullptr),
+      stack_copy_mapped(false),
+      stack_copy_hint(0),
+      _stack_saved_max(0),
+      listed_in(nullptr),
+      list_older(nullptr),
+      list_newer(nullptr),
+      saved_at(0)
+{
+    if (this->region) {
+        this->region->incref();
+    }
+}
+
+StackState::StackState(StackRegion& region)
+    : _stack_start(nullptr),
+      stack_stop(region.top()),
+      stack_copy(nullptr),
+      _stack_saved(0),
+      stack_prev(nullptr),
+      region(&region),
+      stack_copy_capacity(0),
+      stack_copy_compressed(0),
+      stack_copy_retained(0),
+      stack_copy_retained_start(nullptr),
+      stack_copy_mapped(false),
+      stack_copy_hint(0),
+      _stack_saved_max(0),
+      listed_in(nullptr),
+      list_older(nullptr),
+      list_newer(nullptr),
+      saved_at(0)
+{
+    region.incref();
+}
+
+StackState::StackState()
+    : _stack_start(nullptr),
+      stack_stop(nullptr),
+      stack_copy(nullptr),
+      _stack_saved(0),
+      stack_prev(nullptr),
+      region(nullptr),
+      stack_copy_capacity(0),
+      stack_copy_compressed(0),
+      stack_copy_retained(0),
+      stack_copy_retained_start(nullptr),
+      stack_copy_mapped(false),
+      stack_copy_hint(0),
+      _stack_saved_max(0),
+      listed_in(nullptr),
+      list_older(nullptr),
+      list_newer(nullptr),
+      saved_at(0)
+{
+    G_LAYOUT_ASSERT(offsetof(StackState, stack_copy_retained) <= 64,
+                    "The members of StackState used on each switch should fit in a cache line");
+}
+
+StackState::StackState(const StackState& other)
+// can't use a delegating constructor because of
+// MSVC for Python 2.7
+    : _stack_start(nullptr),
+      stack_stop(nullptr),
+      stack_copy(nullptr),
+      _stack_saved(0),
+      stack_prev(nullptr),
+      region(nullptr),
+      stack_copy_capacity(0),
+      stack_copy_compressed(0),
+      stack_copy_retained(0),
+      stack_copy_retained_start(nullptr),
+      stack_copy_mapped(false),
+      stack_copy_hint(0),
+      _stack_saved_max(0),
+      listed_in(nullptr),
+      list_older(nullptr),
+      list_newer(nullptr),
+      saved_at(0)
+{
+    this->operator=(other);
+}
+
+StackState& StackState::operator=(const StackState& other)
+{
+    if (&other == this) {
+        return *this;
+    }
+    if (other.stack_copy) {
+        throw std::runtime_error("Refusing to steal memory.");
+    }
+
+    //If we have memory allocated, dispose of it
+    this->free_stack_copy();
+
+    this->_stack_start = other._stack_start;
+    this->stack_stop = other.stack_stop;
+    this->stack_copy = other.stack_copy;
+    this->_stack_saved = other._stack_saved;
+    this->stack_copy_capacity = other.stack_copy_capacity;
+    this->stack_copy_retained = other.stack_copy_retained;
+    this->stack_copy_retained_start = other.stack_copy_retained_start;
+    this->stack_copy_compressed = 0;
+    this->stack_copy_mapped = false;
+    this->stack_copy_hint = other.stack_copy_hint;
+    this->_stack_saved_max = other._stack_saved_max;
+    this->stack_prev = other.stack_prev;
+    if (other.region) {
+        other.region->incref();
+    }
+    this->release_region();
+    this->region = other.region;
+    return *this;
+}
+
+inline void StackState::set_stack_copy(char* const c,
+                                       const size_t capacity,
+                                       const size_t compressed,
+                                       const bool mapped,
+                                       StackCopyPool* const pool) G_NOEXCEPT
+{
+    if (this->stack_copy && this->stack_copy != c) {
+        if (this->stack_copy_mapped) {
+            SpillFile::unmap(this->stack_copy, this->stack_copy_capacity);
+        }
+        else {
+            StackState::bytes_in_memory -= this->stack_copy_capacity;
+            if (pool && !this->stack_copy_compressed) {
+                pool->put(this->stack_copy, this->stack_copy_capacity);
+            }
+            else {
+                // Compressed copies aren't one of the pool's sizes.
+                PyMem_Free(this->stack_copy);
+            }
+        }
+    }
+    if (c && c != this->stack_copy && !mapped) {
+        StackState::bytes_in_memory += capacity;
+    }
+    this->stack_copy = c;
+    this->stack_copy_capacity = capacity;
+    this->stack_copy_compressed = compressed;
+    this->stack_copy_mapped = mapped;
+}
+
+inline void StackState::free_stack_copy() G_NOEXCEPT
+{
+    this->unlink();
+    this->set_stack_copy(nullptr, 0, 0, false, nullptr);
+    this->_stack_saved = 0;
+    this->stack_copy_retained = 0;
+}
+
+inline void StackState::return_stack_copy(StackCopyPool& pool) G_NOEXCEPT
+{
+    this->unlink();
+    this->set_stack_copy(nullptr, 0, 0, false, &pool);
+    this->_stack_saved = 0;
+    this->stack_copy_retained = 0;
+}
+
+inline void StackState::link(StackCopyPool::StateList& list, const size_t now) G_NOEXCEPT
+{
+    assert(!this->listed_in);
+    this->listed_in = &list;
+    this->saved_at = now;
+    this->list_older = list.newest;
+    this->list_newer = nullptr;
+    if (list.newest) {
+        list.newest->list_newer = this;
+    }
+    else {
+        list.oldest = this;
+    }
+    list.newest = this;
+}
+
+inline void StackState::unlink() G_NOEXCEPT
+{
+    StackCopyPool::StateList* const list = this->listed_in;
+    if (!list) {
+        return;
+    }
+    if (this->list_older) {
+        this->list_older->list_newer = this->list_newer;
+    }
+    else {
+        list->oldest = this->list_newer;
+    }
+    if (this->list_newer) {
+        this->list_newer->list_older = this->list_older;
+    }
+    else {
+        list->newest = this->list_older;
+    }
+    this->listed_in = nullptr;
+    this->list_older = this->list_newer = nullptr;
+}
+
+inline size_t StackState::shrink_stack_copy() G_NOEXCEPT
+{
+    // Compressed and spilled copies are as small as they get.
+    if (this->stack_copy_compressed || this->stack_copy_mapped) {
+        return 0;
+    }
+    size_t wanted;
+#if !defined(_WIN32) && defined(MADV_DONTNEED)
+    if (this->stack_copy_capacity >= 64 * 1024) {
+        // Don't copy big buffers, just give the pages we're not
+        // using back to the OS. (Afterwards, this no longer matches
+        // one of the pool's sizes, so it gets freed, not cached.)
+        const uintptr_t page = StackRegion::page_size();
+        const uintptr_t used = ((uintptr_t)this->stack_copy + this->_stack_saved + page - 1)
+            & ~(page - 1);
+        const uintptr_t end = ((uintptr_t)this->stack_copy + this->stack_copy_capacity)
+            & ~(page - 1);
+        if (end <= used || madvise((void*)used, end - used, MADV_DONTNEED) != 0) {
+            return 0;
+        }
+        wanted = used - (uintptr_t)this->stack_copy;
+    }
+    else
+#endif
+    {
+        wanted = StackCopyPool::capacity_for(this->_stack_saved);
+        if (wanted >= this->stack_copy_capacity) {
+            return 0;
+        }
+        char* const c = (char*)PyMem_Realloc(this->stack_copy, wanted);
+        if (!c) {
+            return 0;
+        }
+        this->stack_copy = c;
+    }
+    const size_t reclaimed = this->stack_copy_capacity - wanted;
+    this->stack_copy_capacity = wanted;
+    this->stack_copy_retained = 0;
+    StackState::bytes_in_memory -= reclaimed;
+    return reclaimed;
+}
+
+size_t StackCopyPool::compact() G_NOEXCEPT
+{
+    size_t reclaimed = 0;
+    // Retained copies are only an optimization.
+    while (StackState* const state = this->retained_list.oldest) {
+        if (!state->stack_copy_mapped) {
+            reclaimed += state->stack_copy_capacity;
+        }
+        state->free_stack_copy();
+    }
+    for (StackState* state = this->saved_list.oldest; state; state = state->list_newer) {
+        reclaimed += state->shrink_stack_copy();
+    }
+    reclaimed += this->trim();
+    this->bytes_compacted += reclaimed;
+    this->last_compaction = this->switches();
+    return reclaimed;
+}
+
+inline void StackCopyPool::did_switch() G_NOEXCEPT
+{
+    this->compress_idle();
+    this->spill_over_limit();
+    if (StackState::compaction_interval
+        && this->switches() - this->last_compaction >= StackState::compaction_interval) {
+        this->compact();
+    }
+}
+
+inline void StackState::compress_stack_copy(StackCopyPool& pool) G_NOEXCEPT
+{
+    // Either way, we won't look at this copy again.
+    this->unlink();
+    const size_t size = this->_stack_saved;
+    if (size < 1024) {
+        return;
+    }
+    const std::clock_t begin = std::clock();
+    // Only worth keeping if it saves at least an eighth.
+    const size_t limit = size - size / 8;
+    const size_t scratch_capacity = StackCopyPool::capacity_for(limit);
+    const size_t table_capacity = StackCopyPool::capacity_for(compression::TABLE_SIZE);
+    char* const scratch = pool.get(scratch_capacity);
+    char* const table = scratch ? pool.get(table_capacity) : nullptr;
+    if (table) {
+        const size_t compressed = compression::compress(this->stack_copy, size,
+                                                        scratch, limit,
+                                                        reinterpret_cast<unsigned*>(table));
+        char* const c = compressed ? (char*)PyMem_Malloc(compressed) : nullptr;
+        if (c) {
+            memcpy(c, scratch, compressed);
+            this->set_stack_copy(c, compressed, compressed, false, &pool);
+            this->stack_copy_retained = 0;
+            pool.bytes_compressed += size;
+            pool.bytes_compressed_to += compressed;
+        }
+        pool.put(table, table_capacity);
+    }
+    if (scratch) {
+        pool.put(scratch, scratch_capacity);
+    }
+    pool.clocks_compressing += std::clock() - begin;
+}
+
+inline void StackState::decompress_to(char* const dest, StackCopyPool& pool) const G_NOEXCEPT
+{
+    const std::clock_t begin = std::clock();
+    if (!compression::decompress(this->stack_copy, this->stack_copy_compressed,
+                                 dest, this->_stack_saved)) {
+        Py_FatalError("greenlet: a compressed saved stack is corrupt");
+    }
+    pool.clocks_compressing += std::clock() - begin;
+}
+
+inline int StackState::decompress_stack_copy(StackCopyPool& pool) G_NOEXCEPT
+{
+    const size_t capacity = StackCopyPool::capacity_for(this->_stack_saved);
+    char* const c = pool.get(capacity);
+    if (!c) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    this->decompress_to(c, pool);
+    this->set_stack_copy(c, capacity, 0, false, &pool);
+    return 0;
+}
+
+inline bool StackState::spill_stack_copy(StackCopyPool& pool) G_NOEXCEPT
+{
+    this->unlink();
+    const size_t page = StackRegion::page_size();
+    if (this->stack_copy_mapped || (size_t)this->_stack_saved < page) {
+        // Nothing to gain.
+        return true;
+    }
+    const size_t length = (this->_stack_saved + page - 1) & ~(page - 1);
+    char* const m = SpillFile::map(length);
+    if (!m) {
+        return false;
+    }
+    memcpy(m, this->stack_copy, this->_stack_saved);
+    // Give the memory back rather than keeping it in the pool.
+    this->set_stack_copy(m, length, 0, true, nullptr);
+    pool.bytes_spilled += this->_stack_saved;
+    return true;
+}
+
+inline void StackCopyPool::spill_over_limit() G_NOEXCEPT
+{
+    while (StackState::bytes_in_memory_limit
+           && StackState::bytes_in_memory > StackState::bytes_in_memory_limit
+           && this->saved_list.oldest) {
+        if (!this->saved_list.oldest->spill_stack_copy(*this)) {
+            break;
+        }
+    }
+}
+
+inline void StackCopyPool::compress_idle() G_NOEXCEPT
+{
+    StackState* const oldest = this->saved_list.oldest;
+    if (oldest
+        && StackState::compress_after_switches
+        && this->switches() - oldest->saved_at >= StackState::compress_after_switches) {
+        oldest->compress_stack_copy(*this);
+    }
+}
+
+inline void StackState::copy_heap_to_stack(StackCopyPool& pool) G_NOEXCEPT
+{
+    // cerr << "copy_heap_to_stack" << endl
+    //      << "\tFrom    : " << *this << endl
+    //      << "\tHead:" << this->region->head
+    //      << endl;
+    /* Restore the heap copy back into the C stack */
+    if (this->stack_copy_compressed) {
+        this->decompress_to(this->_stack_start, pool);
+        this->return_stack_copy(pool);
+    }
+    else if (this->_stack_saved != 0) {
+        memcpy(this->_stack_start, this->stack_copy, this->_stack_saved);
+        // Retained copies are written to when saved again.
+        if (StackState::retain_copies && !this->stack_copy_mapped) {
+            this->unlink();
+            this->link(pool.retained_list, pool.switches());
+            this->stack_copy_retained = this->_stack_saved;
+            this->stack_copy_retained_start = this->_stack_start;
+            this->_stack_saved = 0;
+        }
+        else {
+            this->return_stack_copy(pool);
+        }
+    }
+    // copy_stack_to_heap() already moved the head past anything
+    // dying.
+    StackState* owner = this->region->head;
+    while (owner && owner->stack_stop <= this->stack_stop) {
+        // cerr << "\tOwner: " << owner << endl;
+        owner = owner->stack_prev; /* find greenlet with more stack */
+    }
+    this->stack_prev = owner;
+    // cerr << "\tFinished with: " << *this << endl;
+}
+
+inline int StackState::copy_stack_to_heap_up_to(const char* const stop,
+                                                StackCopyPool& pool) G_NOEXCEPT
+{
+    /* Save more of g's stack into the heap -- at least up to 'stop'
        g->stack_stop |________|
                      |        |
                      |    __ stop       . . . . .
@@ -1146,20 +2519,106 @@ inline int StackState::copy_stack_to_heap_up_to(const char* const stop) G_NOEXCE
     intptr_t sz2 = stop - this->_stack_start;
     assert(this->_stack_start);
     if (sz2 > sz1) {
-        char* c = (char*)PyMem_Realloc(this->stack_copy, sz2);
-        if (!c) {
-            PyErr_NoMemory();
+        if (this->stack_copy_compressed && this->decompress_stack_copy(pool)) {
             return -1;
         }
-        memcpy(c + sz1, this->_stack_start + sz1, sz2 - sz1);
+        if (this->stack_copy_retained_start != this->_stack_start) {
+            // We've been suspended at a different depth; what we
+            // kept doesn't line up with the stack.
+            this->stack_copy_retained = 0;
+        }
+        char* c = this->stack_copy;
+        // A spilled copy may be shared with a forked process, so it's
+        // never written again; it moves back into memory instead.
+        if ((size_t)sz2 > this->stack_copy_capacity || this->stack_copy_mapped) {
+            const size_t capacity = StackCopyPool::capacity_for(
+                !this->stack_copy && this->stack_copy_hint > (size_t)sz2
+                ? this->stack_copy_hint
+                : sz2);
+            c = pool.get(capacity);
+            if (!c) {
+                PyErr_NoMemory();
+                return -1;
+            }
+            if (this->stack_copy) {
+                memcpy(c, this->stack_copy, sz1);
+                pool.buffers_grown++;
+            }
+            this->set_stack_copy(c, capacity, 0, false, &pool);
+            this->stack_copy_retained = 0;
+        }
+        intptr_t start = sz1;
+        if (this->stack_copy_retained > start) {
+            const intptr_t end = this->stack_copy_retained < sz2
+                ? this->stack_copy_retained
+                : sz2;
+            pool.bytes_skipped += this->copy_changed_blocks(c + start,
+                                                            this->_stack_start + start,
+                                                            end - start);
+            start = end;
+        }
+        memcpy(c + start, this->_stack_start + start, sz2 - start);
+        pool.bytes_saved += sz2 - sz1;
         this->stack_copy = c;
         this->_stack_saved = sz2;
+        if (sz2 > this->_stack_saved_max) {
+            this->_stack_saved_max = sz2;
+        }
+        this->stack_copy_retained_start = this->_stack_start;
+        if (this->listed_in != &pool.saved_list) {
+            this->unlink();
+            this->link(pool.saved_list, pool.switches());
+        }
     }
     return 0;
 }
 
+inline intptr_t StackState::copy_changed_blocks(char* dest,
+                                                const char* src,
+                                                intptr_t size) G_NOEXCEPT
+{
+    // Compare a block at a time and only write the blocks that
+    // differ. Returns the number of bytes we didn't have to write.
+    static const intptr_t BLOCK = 128;
+    intptr_t skipped = 0;
+    while (size >= BLOCK) {
+#if defined(GREENLET_BLOCK_COMPARE_SSE2)
+        __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)dest),
+                                    _mm_loadu_si128((const __m128i*)src));
+        for (intptr_t i = 16; i < BLOCK; i += 16) {
+            eq = _mm_and_si128(eq,
+                               _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(dest + i)),
+                                              _mm_loadu_si128((const __m128i*)(src + i))));
+        }
+        const bool same = _mm_movemask_epi8(eq) == 0xFFFF;
+#elif defined(GREENLET_BLOCK_COMPARE_NEON)
+        uint8x16_t eq = vceqq_u8(vld1q_u8((const uint8_t*)dest),
+                                 vld1q_u8((const uint8_t*)src));
+        for (intptr_t i = 16; i < BLOCK; i += 16) {
+            eq = vandq_u8(eq, vceqq_u8(vld1q_u8((const uint8_t*)dest + i),
+                                       vld1q_u8((const uint8_t*)src + i)));
+        }
+        const bool same = vminvq_u8(eq) == 0xFF;
+#else
+        const bool same = memcmp(dest, src, BLOCK) == 0;
+#endif
+        if (same) {
+            skipped += BLOCK;
+        }
+        else {
+            memcpy(dest, src, BLOCK);
+        }
+        dest += BLOCK;
+        src += BLOCK;
+        size -= BLOCK;
+    }
+    memcpy(dest, src, size);
+    return skipped;
+}
+
 inline int StackState::copy_stack_to_heap(char* const stackref,
-                                          const StackState& current) G_NOEXCEPT
+                                          StackState& current,
+                                          StackCopyPool& pool) G_NOEXCEPT
 {
     // cerr << "copy_stack_to_heap: " << endl
     //      << "\tstackref: " << (void*)stackref << endl
@@ -1169,26 +2628,37 @@ inline int StackState::copy_stack_to_heap(char* const stackref,
     /* must free all the C stack up to target_stop */
     const char* const target_stop = this->stack_stop;
 
-    StackState* owner = const_cast<StackState*>(&current);
-    assert(owner->_stack_saved == 0); // everything is present on the stack
-    if (!owner->_stack_start) {
-        // cerr << "\tcurrent is dead; using: " << owner->stack_prev << endl;
-        owner = owner->stack_prev; /* not saved if dying */
+    assert(current._stack_saved == 0); // everything is present on the stack
+    if (current.region == this->region) {
+        pool.switches_within_stack++;
     }
     else {
-        owner->_stack_start = stackref;
+        pool.switches_across_stacks++;
+    }
+    // First, record where the current greenlet leaves its region.
+    if (!current._stack_start) {
+        // cerr << "\tcurrent is dead; using: " << current.stack_prev << endl;
+        current.region->head = current.stack_prev; /* not saved if dying */
+    }
+    else {
+        current._stack_start = stackref;
+        current.region->head = &current;
     }
 
-    while (owner->stack_stop < target_stop) {
+    // Then free up the space we need in the target's region. If
+    // that's a different region than the current one, this usually
+    // finds nothing to do.
+    StackState* owner = this->region->head;
+    while (owner && owner->stack_stop < target_stop) {
         // cerr << "\tCopying from " << *owner << endl;
         /* ts_current is entierely within the area to free */
-        if (owner->copy_stack_to_heap_up_to(owner->stack_stop)) {
+        if (owner->copy_stack_to_heap_up_to(owner->stack_stop, pool)) {
             return -1; /* XXX */
         }
         owner = owner->stack_prev;
     }
-    if (owner != this) {
-        if (owner->copy_stack_to_heap_up_to(target_stop)) {
+    if (owner && owner != this) {
+        if (owner->copy_stack_to_heap_up_to(target_stop, pool)) {
             return -1; /* XXX */
         }
     }
@@ -1229,7 +2699,7 @@ inline void StackState::set_inactive() G_NOEXCEPT
     // Those objects never get deallocated, so the destructor never
     // runs.
     // It *seems* safe to clean up the memory here?
-    if (this->_stack_saved) {
+    if (this->stack_copy) {
         this->free_stack_copy();
     }
 }
@@ -1244,20 +2714,81 @@ inline char* StackState::stack_start() const G_NOEXCEPT
     return this->_stack_start;
 }
 
+inline intptr_t StackState::stack_saved_max() const G_NOEXCEPT
+{
+    return this->_stack_saved_max;
+}
 
-inline StackState StackState::make_main() G_NOEXCEPT
+inline void StackState::set_stack_copy_hint(const size_t size) G_NOEXCEPT
+{
+    this->stack_copy_hint = size;
+}
+
+
+bool StackState::retain_copies = false;
+size_t StackState::compress_after_switches = 0;
+size_t StackState::bytes_in_memory = 0;
+size_t StackState::bytes_in_memory_limit = 0;
+size_t StackState::compaction_interval = 0;
+
+inline bool StackState::owns_region() const G_NOEXCEPT
+{
+    return this->region && this->stack_stop == this->region->top();
+}
+
+inline char* StackState::region_top() const G_NOEXCEPT
+{
+    assert(this->region);
+    return this->region->top();
+}
+
+inline void StackState::release_region() G_NOEXCEPT
+{
+    if (this->region) {
+        if (this->region->head == this) {
+            this->region->head = this->stack_prev;
+        }
+        this->region->decref();
+        this->region = nullptr;
+    }
+}
+
+inline void StackState::leave_region_chain(StackState& current) G_NOEXCEPT
+{
+    if (!this->region) {
+        return;
+    }
+    if (this->region->head == this) {
+        this->region->head = this->stack_prev;
+    }
+    // The running greenlet (*current*) doesn't become the head of
+    // its region until it switches away, but it's the start of the
+    // chain that matters then.
+    for (StackState* s = current.region == this->region ? &current : this->region->head;
+         s;
+         s = s->stack_prev) {
+        if (s->stack_prev == this) {
+            s->stack_prev = this->stack_prev;
+            return;
+        }
+    }
+}
+
+inline StackState StackState::make_main()
 {
     StackState s;
     s._stack_start = (char*)1;
     s.stack_stop = (char*)-1;
+    s.region = StackRegion::for_native_stack();
     return s;
 }
 
 StackState::~StackState()
 {
-    if (this->_stack_saved != 0) {
+    if (this->stack_copy) {
         this->free_stack_copy();
     }
+    this->release_region();
 }
 
 using greenlet::Greenlet;
@@ -1267,6 +2798,142 @@ bool Greenlet::is_currently_running_in_some_thread() const
     return this->stack_state.active() && !this->python_state.top_frame();
 }
 
+// Dispatching to the kind of greenlet this is.
+
+#define GREENLET_AS_MAIN static_cast<MainGreenlet*>(this)
+#define GREENLET_AS_USER static_cast<UserGreenlet*>(this)
+#define GREENLET_AS_CONST_MAIN static_cast<const MainGreenlet*>(this)
+#define GREENLET_AS_CONST_USER static_cast<const UserGreenlet*>(this)
+
+void Greenlet::destroy()
+{
+    if (this->_main_kind) {
+        GREENLET_AS_MAIN->~MainGreenlet();
+    }
+    else {
+        GREENLET_AS_USER->~UserGreenlet();
+    }
+}
+
+const greenlet::refs::BorrowedMainGreenlet Greenlet::main_greenlet() const
+{
+    return this->_main_kind
+        ? GREENLET_AS_CONST_MAIN->main_greenlet()
+        : GREENLET_AS_CONST_USER->main_greenlet();
+}
+
+OwnedObject Greenlet::throw_GreenletExit_during_dealloc(const ThreadState& current_thread_state)
+{
+    return this->_main_kind
+        ? this->_throw_GreenletExit_during_dealloc(current_thread_state)
+        : GREENLET_AS_USER->throw_GreenletExit_during_dealloc(current_thread_state);
+}
+
+OwnedObject Greenlet::g_switch(ThreadState& current_thread_state)
+{
+    return this->_main_kind
+        ? GREENLET_AS_MAIN->g_switch(current_thread_state)
+        : GREENLET_AS_USER->g_switch(current_thread_state);
+}
+
+void Greenlet::murder_in_place()
+{
+    if (this->_main_kind) {
+        this->_murder_in_place();
+    }
+    else {
+        GREENLET_AS_USER->murder_in_place();
+    }
+}
+
+bool Greenlet::belongs_to_thread(const ThreadState* state) const
+{
+    return this->_main_kind
+        ? this->_belongs_to_thread(state)
+        : GREENLET_AS_CONST_USER->belongs_to_thread(state);
+}
+
+greenlet::refs::BorrowedMainGreenlet Greenlet::find_main_greenlet_in_lineage() const
+{
+    return this->_main_kind
+        ? GREENLET_AS_CONST_MAIN->find_main_greenlet_in_lineage()
+        : GREENLET_AS_CONST_USER->find_main_greenlet_in_lineage();
+}
+
+const OwnedGreenlet Greenlet::parent() const
+{
+    return this->_main_kind
+        ? GREENLET_AS_CONST_MAIN->parent()
+        : GREENLET_AS_CONST_USER->parent();
+}
+
+void Greenlet::parent(const greenlet::refs::BorrowedObject new_parent)
+{
+    if (this->_main_kind) {
+        GREENLET_AS_MAIN->parent(new_parent);
+    }
+    else {
+        GREENLET_AS_USER->parent(new_parent);
+    }
+}
+
+const OwnedObject& Greenlet::run() const
+{
+    return this->_main_kind
+        ? GREENLET_AS_CONST_MAIN->run()
+        : GREENLET_AS_CONST_USER->run();
+}
+
+void Greenlet::run(const greenlet::refs::BorrowedObject nrun)
+{
+    if (this->_main_kind) {
+        GREENLET_AS_MAIN->run(nrun);
+    }
+    else {
+        GREENLET_AS_USER->run(nrun);
+    }
+}
+
+int Greenlet::tp_traverse(visitproc visit, void* arg)
+{
+    return this->_main_kind
+        ? GREENLET_AS_MAIN->tp_traverse(visit, arg)
+        : GREENLET_AS_USER->tp_traverse(visit, arg);
+}
+
+int Greenlet::tp_clear()
+{
+    return this->_main_kind
+        ? this->_tp_clear()
+        : GREENLET_AS_USER->tp_clear();
+}
+
+greenlet::ThreadState* Greenlet::thread_state() const G_NOEXCEPT
+{
+    return this->_main_kind
+        ? GREENLET_AS_CONST_MAIN->thread_state()
+        : GREENLET_AS_CONST_USER->thread_state();
+}
+
+bool Greenlet::was_running_in_dead_thread() const G_NOEXCEPT
+{
+    return this->_main_kind
+        ? GREENLET_AS_CONST_MAIN->was_running_in_dead_thread()
+        : GREENLET_AS_CONST_USER->was_running_in_dead_thread();
+}
+
+BorrowedGreenlet Greenlet::self() const G_NOEXCEPT
+{
+    return this->_main_kind
+        ? GREENLET_AS_CONST_MAIN->self()
+        : GREENLET_AS_CONST_USER->self();
+}
+
+#undef GREENLET_AS_MAIN
+#undef GREENLET_AS_USER
+#undef GREENLET_AS_CONST_MAIN
+#undef GREENLET_AS_CONST_USER
+
 
 
 #endif
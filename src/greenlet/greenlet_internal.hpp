@@ -58,7 +58,7 @@ greenlet::refs::MainGreenletExactChecker(void *p)
     if (g->main()) {
         return;
     }
-    if (!dynamic_cast<MainGreenlet*>(g)) {
+    if (!g->main_kind()) {
         std::string err("MainGreenlet: Expected exactly a main greenlet, not a ");
         err += Py_TYPE(p)->tp_name;
         throw greenlet::TypeError(err);
@@ -324,12 +324,26 @@ namespace greenlet {
         // pointer should be a move operation.
         // In the common case of ``OwnedObject x = Py_SomeFunction()``,
         // the call to the copy constructor will be elided completely.
+        // As with assignment, exactly our type has already been
+        // checked, so we don't check it again.
         OwnedReference(const OwnedReference<T, TC>& other)
-            : PyObjectPointer<T, TC>(other.p)
+            : PyObjectPointer<T, TC>(nullptr)
         {
+            this->p = other.p;
             Py_XINCREF(this->p);
         }
 
+#if G_HAS_MOVE_SEMANTICS
+        // Moving takes over the reference and leaves *other* empty,
+        // without touching the refcount.
+        OwnedReference(OwnedReference<T, TC>&& other) G_NOEXCEPT
+            : PyObjectPointer<T, TC>(nullptr)
+        {
+            this->p = other.p;
+            other.p = nullptr;
+        }
+#endif
+
         static OwnedReference<PyObject> None()
         {
             Py_INCREF(Py_None);
@@ -346,6 +360,20 @@ namespace greenlet {
             return *this;
         }
 
+#if G_HAS_MOVE_SEMANTICS
+        // Not G_NOEXCEPT: releasing what we held can run arbitrary code.
+        OwnedReference<T, TC>& operator=(OwnedReference<T, TC>&& other)
+        {
+            if (this != &other) {
+                T* tmp = this->p;
+                this->p = other.p;
+                other.p = nullptr;
+                Py_XDECREF(tmp);
+            }
+            return *this;
+        }
+#endif
+
         OwnedReference<T, TC>& operator=(const BorrowedReference<T, TC> other)
         {
             return this->operator=(other.borrow());
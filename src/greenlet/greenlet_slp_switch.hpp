@@ -30,19 +30,38 @@
 // ``slp_save_state_asm`()` to fetch the pointer to pass to the
 // macro.)
 //
-// Our compromise is to use a *glabal*, untracked, weak, pointer
-// to the necessary thread state during the process of switching only.
-// This is safe because we're protected by the GIL, and if we're
-// running this code, the thread isn't exiting. This also nets us a
-// 10-12% speed improvement.
+// (The crashes come from reading the argument after the stack
+// pointer has moved: any copy of it the compiler left on the stack
+// now belongs to a different call.)
+//
+// Platforms whose slp_switch() has been rewritten to take care of
+// that define SLP_HAVE_SWITCH_CONTEXT. They take the greenlet being
+// switched to as an argument, hand it to the save and restore
+// functions, and return it (see SLP_SAVE_STATE_CONTEXT and
+// SLP_RESTORE_STATE_CONTEXT).
+//
+// Everywhere else, our compromise is to use a *glabal*, untracked,
+// weak, pointer to the necessary thread state during the process of
+// switching only. This is safe because we're protected by the GIL,
+// and if we're running this code, the thread isn't exiting. This
+// also nets us a 10-12% speed improvement.
 
-static greenlet::Greenlet* volatile switching_thread_state = nullptr;
+// Only one of these styles is used (and defined) on any platform.
+#if defined(__GNUC__) || defined(__clang__)
+#    define G_SWITCH_STYLE_UNUSED __attribute__((__unused__))
+#else
+#    define G_SWITCH_STYLE_UNUSED
+#endif
 
+static greenlet::Greenlet* volatile switching_thread_state
+    G_SWITCH_STYLE_UNUSED = nullptr;
 
 #ifdef GREENLET_NOINLINE_SUPPORTED
 extern "C" {
-static int GREENLET_NOINLINE(slp_save_state_trampoline)(char* stackref);
-static void GREENLET_NOINLINE(slp_restore_state_trampoline)();
+static int GREENLET_NOINLINE(slp_save_state_trampoline)(char* stackref) G_SWITCH_STYLE_UNUSED;
+static void GREENLET_NOINLINE(slp_restore_state_trampoline)() G_SWITCH_STYLE_UNUSED;
+static int GREENLET_NOINLINE(slp_save_state_context_trampoline)(void* context, char* stackref) G_SWITCH_STYLE_UNUSED;
+static void* GREENLET_NOINLINE(slp_restore_state_context_trampoline)(void* context) G_SWITCH_STYLE_UNUSED;
 }
 #define GREENLET_NOINLINE_INIT() \
     do {                         \
@@ -51,6 +70,7 @@ static void GREENLET_NOINLINE(slp_restore_state_trampoline)();
 /* force compiler to call functions via pointers */
 /* XXX: Do we even want/need to support such compilers? This code path
    is untested on CI. */
+/* (The platforms with SLP_HAVE_SWITCH_CONTEXT all support noinline.) */
 extern "C" {
 static int (slp_save_state_trampoline)(char* stackref);
 static void (slp_restore_state_trampoline)();
@@ -76,6 +96,22 @@ do {                                                    \
 
 #define SLP_RESTORE_STATE() slp_restore_state_trampoline()
 
+// What slp_switch(context) returns when it didn't switch.
+#define SLP_SWITCH_FAILED ((void*)-1)
+#define SLP_SWITCH_STARTED ((void*)1)
+
+#define SLP_SAVE_STATE_CONTEXT(context, stackref, stsizediff) \
+do {                                                    \
+    stackref += STACK_MAGIC;                 \
+    if (slp_save_state_context_trampoline(context, (char*)stackref)) \
+        return SLP_SWITCH_FAILED;                      \
+    if (!static_cast<greenlet::Greenlet*>(context)->active()) \
+        return SLP_SWITCH_STARTED;                     \
+    stsizediff = static_cast<greenlet::Greenlet*>(context)->stack_start() - (char*)stackref; \
+} while (0)
+
+#define SLP_RESTORE_STATE_CONTEXT(context) slp_restore_state_context_trampoline(context)
+
 #define SLP_EVAL
 extern "C" {
 #define slp_switch GREENLET_NOINLINE(slp_switch)
@@ -88,6 +124,28 @@ extern "C" {
         "greenlet needs to be ported to this platform, or taught how to detect your compiler properly."
 #endif /* !STACK_MAGIC */
 
+#ifdef SLP_HAVE_SWITCH_CONTEXT
+#    define GREENLET_SWITCH_CONTEXT 1
+#else
+#    define GREENLET_SWITCH_CONTEXT 0
+#endif
+
+// Whether the platform honored GREENLET_LEAN_SWITCH and doesn't keep
+// floating point control state per greenlet.
+#ifdef SLP_HAVE_LEAN_SWITCH
+#    define GREENLET_USE_LEAN_SWITCH 1
+#else
+#    define GREENLET_USE_LEAN_SWITCH 0
+#endif
+
+// Greenlets can only be given a stack of their own if the platform
+// knows how to begin running on one.
+#if defined(SLP_HAVE_START_ON_STACK) && GREENLET_SWITCH_CONTEXT && !defined(_WIN32)
+#    define GREENLET_USE_DEDICATED_STACKS 1
+#else
+#    define GREENLET_USE_DEDICATED_STACKS 0
+#endif
+
 
 
 #ifdef EXTERNAL_ASM
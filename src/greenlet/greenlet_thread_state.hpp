@@ -105,21 +105,38 @@ private:
     OwnedObject tracefunc;
 
     typedef std::vector<PyGreenlet*, PythonAllocator<PyGreenlet*> > deleteme_t;
-    /* A vector of raw PyGreenlet pointers representing things that need
-       deleted when this thread is running. The vector owns the
-       references, but you need to manually INCREF/DECREF as you use
-       them. We don't use a vector<refs::OwnedGreenlet> because we
-       make copy of this vector, and that would become O(n) as all the
-       refcounts are incremented in the copy.
+    /* Greenlets that other threads need deleted when this thread is
+       running, most recent first, linked through the greenlets
+       themselves. The list owns a reference to each. Other threads
+       push onto it without locking, and we take the whole list at
+       once, so neither side needs the GIL to protect it; getting
+       the current greenlet only has to check it for null.
     */
-    deleteme_t deleteme;
+    AtomicPointer<PyGreenlet> deleteme;
+
+    /* Buffers for saving the stacks of this thread's greenlets. */
+    StackCopyPool _stack_copy_pool;
+
+    /* Deallocated greenlet objects (of exactly the greenlet type),
+       kept to be reused by green_new(). They are untracked and have
+       no references; each one's pimpl points to the memory, inside
+       the object, of a destroyed UserGreenlet. */
+    deleteme_t dead_greenlets;
+
+    /* Frame memory for new greenlets, from finished ones. */
+    FrameChunkCache _frame_chunk_cache;
+
+    typedef std::vector<StackRegion*, PythonAllocator<StackRegion*> > stack_groups_t;
+    /* The shared stacks for greenlets created with a ``stack_group``,
+       indexed by group. Allocated on first use; we own a reference
+       to each. */
+    stack_groups_t stack_groups;
 
 #ifdef GREENLET_NEEDS_EXCEPTION_STATE_SAVED
     void* exception_state;
 #endif
 
     static std::clock_t _clocks_used_doing_gc;
-    static ImmortalString get_referrers_name;
     static PythonAllocator<ThreadState> allocator;
 
     G_NO_COPIES_OF_CLS(ThreadState);
@@ -138,7 +155,6 @@ public:
 
     static void init()
     {
-        ThreadState::get_referrers_name = "get_referrers";
         ThreadState::_clocks_used_doing_gc = 0;
     }
 
@@ -153,6 +169,10 @@ public:
         // The main greenlet starts with 1 refs: The returned one. We
         // then copied it to the current greenlet.
         assert(this->main_greenlet.REFCNT() == 2);
+        // What a switch uses, here and at the start of the pool,
+        // should share two cache lines.
+        G_LAYOUT_ASSERT(offsetof(ThreadState, _stack_copy_pool) <= 64,
+                        "ThreadState members used on each switch are spread out");
 
 #ifdef GREENLET_NEEDS_EXCEPTION_STATE_SAVED
         this->exception_state = slp_get_exception_state();
@@ -210,7 +230,9 @@ public:
     {
         /* green_dealloc() cannot delete greenlets from other threads, so
            it stores them in the thread dict; delete them now. */
-        this->clear_deleteme_list();
+        if (this->deleteme.peek()) {
+            this->clear_deleteme_list();
+        }
         //assert(this->current_greenlet->main_greenlet == this->main_greenlet);
         //assert(this->main_greenlet->main_greenlet == this->main_greenlet);
         return this->current_greenlet;
@@ -221,7 +243,9 @@ public:
      */
     inline BorrowedGreenlet borrow_current()
     {
-        this->clear_deleteme_list();
+        if (this->deleteme.peek()) {
+            this->clear_deleteme_list();
+        }
         return this->current_greenlet;
     }
 
@@ -244,10 +268,68 @@ public:
         this->current_greenlet = target;
     }
 
+    inline StackCopyPool& stack_copy_pool()
+    {
+        return this->_stack_copy_pool;
+    }
+
+    inline FrameChunkCache& frame_chunk_cache()
+    {
+        return this->_frame_chunk_cache;
+    }
+
+    /**
+     * The most greenlet objects we'll keep around for reuse.
+     */
+    static const size_t MAX_DEAD_GREENLETS = 128;
+
+    /**
+     * Keep the memory of *dead*, whose UserGreenlet has been
+     * destroyed, for reuse. Returns false if we have enough already,
+     * in which case the caller should free it.
+     */
+    inline bool keep_dead_greenlet(PyGreenlet* dead)
+    {
+        if (this->dead_greenlets.size() >= MAX_DEAD_GREENLETS) {
+            return false;
+        }
+        this->dead_greenlets.push_back(dead);
+        return true;
+    }
+
+    /**
+     * Take back a greenlet object given to keep_dead_greenlet(), or
+     * return null.
+     */
+    inline PyGreenlet* reuse_dead_greenlet()
+    {
+        if (this->dead_greenlets.empty()) {
+            return nullptr;
+        }
+        PyGreenlet* result = this->dead_greenlets.back();
+        this->dead_greenlets.pop_back();
+        return result;
+    }
+
+    /**
+     * Return the shared stack for *group*, mapping one of *size*
+     * bytes if this is its first use. Throws on failure.
+     */
+    inline StackRegion& stack_group(const size_t group, const size_t size)
+    {
+        if (group >= this->stack_groups.size()) {
+            this->stack_groups.resize(group + 1, nullptr);
+        }
+        if (!this->stack_groups[group]) {
+            this->stack_groups[group] = StackRegion::allocate(size);
+        }
+        return *this->stack_groups[group];
+    }
+
 private:
     /**
      * Deref and remove the greenlets from the deleteme list. Must be
-     * holding the GIL.
+     * holding the GIL (to do the derefs).
      *
      * If *murder* is true, then we must be called from a different
      * thread than the one that these greenlets were running in.
@@ -256,35 +338,40 @@ private:
      * proceeding; otherwise, we would try (and fail) to raise an
      * exception in it and wind up right back in this list.
      */
-    inline void clear_deleteme_list(const bool murder=false)
-    {
-        if (!this->deleteme.empty()) {
-            // It's possible we could add items to this list while
-            // running Python code if there's a thread switch, so we
-            // need to defensively copy it before that can happen.
-            deleteme_t copy = this->deleteme;
-            this->deleteme.clear(); // in case things come back on the list
-            for(deleteme_t::iterator it = copy.begin(), end = copy.end();
-                it != end;
-                ++it ) {
-                PyGreenlet* to_del = *it;
-                if (murder) {
-                    // Force each greenlet to appear dead; we can't raise an
-                    // exception into it anymore anyway.
-                    to_del->pimpl->murder_in_place();
-                }
-
-                // The only reference to these greenlets should be in
-                // this list, decreffing them should let them be
-                // deleted again, triggering calls to green_dealloc()
-                // in the correct thread (if we're not murdering).
-                // This may run arbitrary Python code and switch
-                // threads or greenlets!
-                Py_DECREF(to_del);
-                if (PyErr_Occurred()) {
-                    PyErr_WriteUnraisable(nullptr);
-                    PyErr_Clear();
-                }
+    void GREENLET_NOINLINE(clear_deleteme_list)(const bool murder=false)
+    {
+        // It's possible we could add items to this list while
+        // running Python code if there's a thread switch, so we take
+        // the whole list now; those will wait for the next call.
+        PyGreenlet* to_del = this->deleteme.take();
+        // Delete them in the order they were added.
+        PyGreenlet* oldest = nullptr;
+        while (to_del) {
+            PyGreenlet* const next = to_del->pimpl->_next_pending_delete;
+            to_del->pimpl->_next_pending_delete = oldest;
+            oldest = to_del;
+            to_del = next;
+        }
+        while (oldest) {
+            to_del = oldest;
+            oldest = to_del->pimpl->_next_pending_delete;
+            to_del->pimpl->_next_pending_delete = nullptr;
+            if (murder) {
+                // Force each greenlet to appear dead; we can't raise an
+                // exception into it anymore anyway.
+                to_del->pimpl->murder_in_place();
+            }
+
+            // The only reference to these greenlets should be in
+            // this list, decreffing them should let them be
+            // deleted again, triggering calls to green_dealloc()
+            // in the correct thread (if we're not murdering).
+            // This may run arbitrary Python code and switch
+            // threads or greenlets!
+            Py_DECREF(to_del);
+            if (PyErr_Occurred()) {
+                PyErr_WriteUnraisable(nullptr);
+                PyErr_Clear();
             }
         }
     }
@@ -319,7 +406,10 @@ public:
     inline void delete_when_thread_running(PyGreenlet* to_del)
     {
         Py_INCREF(to_del);
-        this->deleteme.push_back(to_del);
+        PyGreenlet* head = this->deleteme.peek();
+        do {
+            to_del->pimpl->_next_pending_delete = head;
+        } while (!this->deleteme.compare_exchange(head, to_del));
     }
 
     /**
@@ -353,76 +443,15 @@ public:
 
         // If the main greenlet is the current greenlet,
         // then we "fell off the end" and the thread died.
-        // It's possible that there is some other greenlet that
-        // switched to us, leaving a reference to the main greenlet
-        // on the stack, somewhere uncollectible. Try to detect that.
+        // Some other greenlet that switched to us may have left a
+        // reference to the main greenlet in one of its frames; if
+        // so, the greenlet dropped it when we murdered it above.
         if (this->current_greenlet == this->main_greenlet && this->current_greenlet) {
             assert(this->current_greenlet->is_currently_running_in_some_thread());
             // Drop one reference we hold.
             this->current_greenlet.CLEAR();
             assert(!this->current_greenlet);
-            // Only our reference to the main greenlet should be left,
-            // But hold onto the pointer in case we need to do extra cleanup.
-            PyGreenlet* old_main_greenlet = this->main_greenlet.borrow();
-            Py_ssize_t cnt = this->main_greenlet.REFCNT();
             this->main_greenlet.CLEAR();
-            if (ThreadState::_clocks_used_doing_gc != std::clock_t(-1)
-                && cnt == 2 && Py_REFCNT(old_main_greenlet) == 1) {
-                // Highly likely that the reference is somewhere on
-                // the stack, not reachable by GC. Verify.
-                // XXX: This is O(n) in the total number of objects.
-                // TODO: Add a way to disable this at runtime, and
-                // another way to report on it.
-                std::clock_t begin = std::clock();
-                NewReference gc(PyImport_ImportModule("gc"));
-                if (gc) {
-                    OwnedObject get_referrers = gc.PyRequireAttr(ThreadState::get_referrers_name);
-                    OwnedList refs(get_referrers.PyCall(old_main_greenlet));
-                    if (refs && refs.empty()) {
-                        assert(refs.REFCNT() == 1);
-                        // We found nothing! So we left a dangling
-                        // reference: Probably the last thing some
-                        // other greenlet did was call
-                        // 'getcurrent().parent.switch()' to switch
-                        // back to us. Clean it up. This will be the
-                        // case on CPython 3.7 and newer, as they use
-                        // an internal calling conversion that avoids
-                        // creating method objects and storing them on
-                        // the stack.
-                        Py_DECREF(old_main_greenlet);
-                    }
-                    else if (refs
-                             && refs.size() == 1
-                             && PyCFunction_Check(refs.at(0))
-                             && Py_REFCNT(refs.at(0)) == 2) {
-                        assert(refs.REFCNT() == 1);
-                        // Ok, we found a C method that refers to the
-                        // main greenlet, and its only referenced
-                        // twice, once in the list we just created,
-                        // once from...somewhere else. If we can't
-                        // find where else, then this is a leak.
-                        // This happens in older versions of CPython
-                        // that create a bound method object somewhere
-                        // on the stack that we'll never get back to.
-                        if (PyCFunction_GetFunction(refs.at(0).borrow()) == (PyCFunction)green_switch) {
-                            BorrowedObject function_w = refs.at(0);
-                            refs.clear(); // destroy the reference
-                                          // from the list.
-                            // back to one reference. Can *it* be
-                            // found?
-                            assert(function_w.REFCNT() == 1);
-                            refs = get_referrers.PyCall(function_w);
-                            if (refs && refs.empty()) {
-                                // Nope, it can't be found so it won't
-                                // ever be GC'd. Drop it.
-                                Py_CLEAR(function_w);
-                            }
-                        }
-                    }
-                    std::clock_t end = std::clock();
-                    ThreadState::_clocks_used_doing_gc += (end - begin);
-                }
-            }
         }
 
         // We need to make sure this greenlet appears to be dead,
@@ -451,6 +480,25 @@ public:
             this->main_greenlet.CLEAR();
         }
 
+        // Greenlets still using these stacks keep them alive.
+        for (stack_groups_t::iterator it = this->stack_groups.begin(),
+                 end = this->stack_groups.end();
+             it != end;
+             ++it) {
+            if (*it) {
+                (*it)->decref();
+            }
+        }
+        this->stack_groups.clear();
+
+        for (deleteme_t::iterator it = this->dead_greenlets.begin(),
+                 end = this->dead_greenlets.end();
+             it != end;
+             ++it) {
+            PyObject_GC_Del(*it);
+        }
+        this->dead_greenlets.clear();
+
         if (PyErr_Occurred()) {
             PyErr_WriteUnraisable(NULL);
             PyErr_Clear();
@@ -460,7 +508,6 @@ public:
 
 };
 
-ImmortalString ThreadState::get_referrers_name(nullptr);
 PythonAllocator<ThreadState> ThreadState::allocator;
 std::clock_t ThreadState::_clocks_used_doing_gc(0);
 
@@ -472,6 +519,22 @@ private:
     // Set to 0 on destruction.
     ThreadState* _state;
     G_NO_COPIES_OF_CLS(ThreadStateCreator);
+    // Kept out of line so that state(), which is used by every
+    // call to getcurrent(), can be inlined into its callers.
+    void GREENLET_NOINLINE(create_state)()
+    {
+        // XXX: Assuming allocation never fails
+        this->_state = new ThreadState;
+        // For non-standard threading, we need to store an object
+        // in the Python thread state dictionary so that it can be
+        // DECREF'd when the thread ends (ideally; the dict could
+        // last longer) and clean this object up.
+    }
+
+    void GREENLET_NOINLINE(destroyed)() const
+    {
+        throw std::runtime_error("Accessing state after destruction.");
+    }
 public:
 
     // Only one of these, auto created per thread
@@ -499,15 +562,10 @@ public:
         // thread, and hence the thread-local storage, will delete the
         // state pointer in the main greenlet.
         if (this->_state == (ThreadState*)1) {
-            // XXX: Assuming allocation never fails
-            this->_state = new ThreadState;
-            // For non-standard threading, we need to store an object
-            // in the Python thread state dictionary so that it can be
-            // DECREF'd when the thread ends (ideally; the dict could
-            // last longer) and clean this object up.
+            this->create_state();
         }
         if (!this->_state) {
-            throw std::runtime_error("Accessing state after destruction.");
+            this->destroyed();
         }
         return *this->_state;
     }
@@ -522,6 +580,18 @@ public:
         return &this->state();
     }
 
+    /**
+     * The state, if this thread has created one and it hasn't been
+     * destroyed; otherwise null. Never creates it.
+     */
+    inline ThreadState* borrow_if_exists() const
+    {
+        if (this->_state == (ThreadState*)1) {
+            return nullptr;
+        }
+        return this->_state;
+    }
+
     inline int tp_traverse(visitproc visit, void* arg)
     {
         if (this->_state) {
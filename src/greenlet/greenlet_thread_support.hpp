@@ -141,4 +141,78 @@ namespace greenlet {
 };
 #endif /* G_USE_STANDARD_THREADING == 1 */
 
+#if G_USE_STANDARD_THREADING == 1
+#    include <atomic>
+namespace greenlet {
+    /**
+     * A pointer that any thread may replace, for lock-free lists.
+     */
+    template<typename T>
+    class AtomicPointer
+    {
+        std::atomic<T*> p;
+        G_NO_COPIES_OF_CLS(AtomicPointer);
+    public:
+        AtomicPointer() : p(nullptr)
+        {}
+
+        // Only a hint, unless the caller is the only one who takes.
+        inline T* peek() const
+        {
+            return this->p.load(std::memory_order_relaxed);
+        }
+
+        inline T* take()
+        {
+            return this->p.exchange(nullptr, std::memory_order_acquire);
+        }
+
+        // If we still hold *expected*, replace it with *desired*.
+        // Otherwise, update *expected* to what we hold.
+        inline bool compare_exchange(T*& expected, T* desired)
+        {
+            return this->p.compare_exchange_weak(expected, desired,
+                                                 std::memory_order_release,
+                                                 std::memory_order_relaxed);
+        }
+    };
+};
+#else
+namespace greenlet {
+    // Without standard threading (Python 2.7 on Windows), these are
+    // only used while holding the GIL.
+    template<typename T>
+    class AtomicPointer
+    {
+        T* p;
+        G_NO_COPIES_OF_CLS(AtomicPointer);
+    public:
+        AtomicPointer() : p(nullptr)
+        {}
+
+        inline T* peek() const
+        {
+            return this->p;
+        }
+
+        inline T* take()
+        {
+            T* const result = this->p;
+            this->p = nullptr;
+            return result;
+        }
+
+        inline bool compare_exchange(T*& expected, T* desired)
+        {
+            if (this->p != expected) {
+                expected = this->p;
+                return false;
+            }
+            this->p = desired;
+            return true;
+        }
+    };
+};
+#endif
+
 #endif /* GREENLET_THREAD_SUPPORT_HPP */
@@ -21,58 +21,67 @@
                      "v8", "v9", "v10", "v11", \
                      "v12", "v13", "v14", "v15"
 
-static int
-slp_switch(void)
+/*
+ * The kernel takes a context pointer, which it gives to the save and
+ * restore callbacks. It's carried across the switch in a register,
+ * since the stack it was on before is not the stack we return on.
+ * Returns what the restore callback returned, or the value the save
+ * callback made it return early with.
+ */
+#define SLP_HAVE_SWITCH_CONTEXT 1
+static void*
+slp_switch(void* context)
 {
-	int err;
+	void* result;
 	void *fp;
         long *stackref, stsizediff;
         __asm__ volatile ("" : : : REGS_TO_SAVE);
 	__asm__ volatile ("str x29, %0" : "=m"(fp) : : );
         __asm__ ("mov %0, sp" : "=r" (stackref));
         {
-                SLP_SAVE_STATE(stackref, stsizediff);
+                SLP_SAVE_STATE_CONTEXT(context, stackref, stsizediff);
                 __asm__ volatile (
-                    "add sp,sp,%0\n"
-                    "add x29,x29,%0\n"
-                    :
+                    "add sp,sp,%1\n"
+                    "add x29,x29,%1\n"
+                    : "+r" (context)
                     : "r" (stsizediff)
                     );
-		SLP_RESTORE_STATE();
-		/* SLP_SAVE_STATE macro contains some return statements
-		   (of -1 and 1).  It falls through only when
-		   the return value of slp_save_state() is zero, which
-		   is placed in x0.
-		   In that case we (slp_switch) also want to return zero
-		   (also in x0 of course).
-		   Now, some GCC versions (seen with 4.8) think it's a
-		   good idea to save/restore x0 around the call to
-		   slp_restore_state(), instead of simply zeroing it
-		   at the return below.  But slp_restore_state
-		   writes random values to the stack slot used for this
-		   save/restore (from when it once was saved above in
-		   SLP_SAVE_STATE, when it was still uninitialized), so
-		   "restoring" that precious zero actually makes us
-		   return random values.  There are some ways to make
-		   GCC not use that zero value in the normal return path
-		   (e.g. making err volatile, but that costs a little
-		   stack space), and the simplest is to call a function
-		   that returns an unknown value (which happens to be zero),
-		   so the saved/restored value is unused.  */
-                /* XXX: This line produces warnings:
-
-                   value size does not match register size specified by the
-                   constraint and modifier
-
-                   The suggested fix is to change %0 to %w0.
-
-                   TODO: Validate and change that.
-                 */
-           __asm__ volatile ("mov %0, #0" : "=r" (err));
+		/* Unlike the old version of this function, which
+		   returned a constant 0 here, the result is whatever
+		   the restore callback returns, so GCC can't try to
+		   save and restore it around the call (which, after
+		   the switch, reads a stack slot that belongs to some
+		   other call). */
+		result = SLP_RESTORE_STATE_CONTEXT(context);
         }
         __asm__ volatile ("ldr x29, %0" : : "m" (fp) :);
         __asm__ volatile ("" : : : REGS_TO_SAVE);
-        return err;
+        return result;
+}
+
+/*
+ * Begin executing ``func(context)`` with the stack pointer at ``stack_top``
+ * (which must be 16-byte aligned). Used to start greenlets that have
+ * a stack of their own. Never returns; the frames of the caller are
+ * abandoned, so it must already be saved the way ``slp_switch`` saves
+ * it.
+ */
+#define SLP_HAVE_START_ON_STACK 1
+static void
+slp_start_on_stack(char* stack_top, void (*func)(void*), void* context)
+{
+        register void* x0 __asm__("x0") = context;
+        __asm__ volatile (
+            "mov sp, %0\n"
+            "mov x29, xzr\n"
+            "mov x30, xzr\n"
+            "blr %1\n"
+            "brk #0\n"
+            :
+            : "r" (stack_top), "r" (func), "r" (x0)
+            : "memory"
+            );
+        __builtin_unreachable();
 }
 
 #endif
@@ -36,41 +36,102 @@
 
 #define REGS_TO_SAVE "r12", "r13", "r14", "r15"
 
-static int
-slp_switch(void)
+/*
+ * Building with GREENLET_LEAN_SWITCH defined (setup.py does that
+ * when the environment variable of the same name is set) leaves out
+ * saving and restoring the x87 control word and MXCSR. Those hold
+ * the floating point rounding mode and exception masks, which then
+ * belong to the thread instead of to each greenlet. Builds with
+ * assertions enabled check that MXCSR is the same after a switch as
+ * it was when the greenlet we return to switched away.
+ */
+#ifdef GREENLET_LEAN_SWITCH
+#define SLP_HAVE_LEAN_SWITCH 1
+#endif
+
+/*
+ * The kernel takes a context pointer, which it gives to the save and
+ * restore callbacks. It's carried across the switch in a register,
+ * since the stack it was on before is not the stack we return on.
+ * Returns what the restore callback returned, or the value the save
+ * callback made it return early with.
+ */
+#define SLP_HAVE_SWITCH_CONTEXT 1
+static void*
+slp_switch(void* context)
 {
-    int err;
+    void* result;
     void* rbp;
     void* rbx;
+#if !defined(SLP_HAVE_LEAN_SWITCH) || !defined(NDEBUG)
     unsigned int csr;
+#endif
+#ifndef SLP_HAVE_LEAN_SWITCH
     unsigned short cw;
+#endif
     /* This used to be declared 'register', but that does nothing in
     modern compilers and is explicitly forbidden in some new
     standards. */
     long *stackref, stsizediff;
     __asm__ volatile ("" : : : REGS_TO_SAVE);
+#ifndef SLP_HAVE_LEAN_SWITCH
     __asm__ volatile ("fstcw %0" : "=m" (cw));
     __asm__ volatile ("stmxcsr %0" : "=m" (csr));
+#elif !defined(NDEBUG)
+    __asm__ volatile ("stmxcsr %0" : "=m" (csr));
+#endif
     __asm__ volatile ("movq %%rbp, %0" : "=m" (rbp));
     __asm__ volatile ("movq %%rbx, %0" : "=m" (rbx));
     __asm__ ("movq %%rsp, %0" : "=g" (stackref));
     {
-        SLP_SAVE_STATE(stackref, stsizediff);
+        SLP_SAVE_STATE_CONTEXT(context, stackref, stsizediff);
         __asm__ volatile (
-            "addq %0, %%rsp\n"
-            "addq %0, %%rbp\n"
-            :
+            "addq %1, %%rsp\n"
+            "addq %1, %%rbp\n"
+            : "+r" (context)
             : "r" (stsizediff)
             );
-        SLP_RESTORE_STATE();
-        __asm__ volatile ("xorq %%rax, %%rax" : "=a" (err));
+        result = SLP_RESTORE_STATE_CONTEXT(context);
     }
     __asm__ volatile ("movq %0, %%rbx" : : "m" (rbx));
     __asm__ volatile ("movq %0, %%rbp" : : "m" (rbp));
+#ifndef SLP_HAVE_LEAN_SWITCH
     __asm__ volatile ("ldmxcsr %0" : : "m" (csr));
     __asm__ volatile ("fldcw %0" : : "m" (cw));
+#elif !defined(NDEBUG)
+    {
+        unsigned int now;
+        __asm__ volatile ("stmxcsr %0" : "=m" (now));
+        assert(now == csr
+               && "MXCSR changed across a greenlet switch; "
+                  "GREENLET_LEAN_SWITCH builds share it between greenlets");
+    }
+#endif
     __asm__ volatile ("" : : : REGS_TO_SAVE);
-    return err;
+    return result;
+}
+
+/*
+ * Begin executing ``func(context)`` with the stack pointer at ``stack_top``
+ * (which must be 16-byte aligned). Used to start greenlets that have
+ * a stack of their own. Never returns; the frames of the caller are
+ * abandoned, so it must already be saved the way ``slp_switch`` saves
+ * it.
+ */
+#define SLP_HAVE_START_ON_STACK 1
+static void
+slp_start_on_stack(char* stack_top, void (*func)(void*), void* context)
+{
+    __asm__ volatile (
+        "movq %0, %%rsp\n"
+        "xorq %%rbp, %%rbp\n"
+        "callq *%1\n"
+        "ud2\n"
+        :
+        : "r" (stack_top), "r" (func), "D" (context)
+        : "memory"
+        );
+    __builtin_unreachable();
 }
 
 #endif
@@ -137,6 +137,36 @@ class ContextVarsTests(TestCase):
         let1.switch()
         let2.switch()
 
+    def test_cached_lookups_across_switches(self):
+        # Repeated get() calls can be answered from the variable's
+        # cache; switching must invalidate that whenever the context
+        # changes, but greenlets sharing a context share its values.
+        def run(expect, value):
+            while True:
+                self.assertEqual(VAR_VAR.get(), expect)
+                VAR_VAR.set(value)
+                self.assertEqual(VAR_VAR.get(), value)
+                expect, value = getcurrent().parent.switch(VAR_VAR.get())
+
+        VAR_VAR.set('main')
+        shared = copy_context()
+        let1 = greenlet(run)
+        let2 = greenlet(run)
+        let3 = greenlet(run)
+        let1.gr_context = shared
+        let2.gr_context = shared
+        let3.gr_context = copy_context()
+
+        self.assertEqual(let1.switch('main', 1), 1)
+        self.assertEqual(VAR_VAR.get(), 'main')
+        self.assertEqual(let3.switch('main', 3), 3)
+        self.assertEqual(VAR_VAR.get(), 'main')
+        self.assertEqual(let2.switch(1, 2), 2)
+        self.assertEqual(let1.switch(2, 4), 4)
+        self.assertEqual(let3.switch(3, 5), 5)
+        self.assertEqual(VAR_VAR.get(), 'main')
+        self.assertEqual(shared[VAR_VAR], 4)
+
     def test_context_assignment_while_running(self):
         # pylint:disable=too-many-statements
         ID_VAR.set(None)
@@ -12,6 +12,7 @@ from abc import ABCMeta, abstractmethod
 from greenlet import greenlet
 from . import TestCase
 from .leakcheck import fails_leakcheck
+from .leakcheck import ignores_leakcheck
 
 
 # We manually manage locks in many tests
@@ -84,6 +85,63 @@ class TestGreenlet(TestCase):
         self.assertIsNotNone(g)
         self.assertIsNone(g.run)
 
+    def test_constructor_arguments(self):
+        main = greenlet.getcurrent()
+        parent = greenlet()
+        for g in (greenlet(len), greenlet(len, parent),
+                  greenlet(len, parent=parent), greenlet(run=len, parent=parent)):
+            self.assertIs(g.run, len)
+        self.assertIs(greenlet(len).parent, main)
+        self.assertIs(greenlet(len, None).parent, main)
+        self.assertIs(greenlet(len, parent).parent, parent)
+        self.assertIs(greenlet(len, parent=parent).parent, parent)
+        with self.assertRaises(TypeError):
+            greenlet(len, parent, 0, None, None)
+        with self.assertRaises(TypeError):
+            greenlet(len, main, bad=1)
+        with self.assertRaises(TypeError):
+            greenlet(len, 42)
+
+    def test_reused_greenlets_are_fresh(self):
+        # Deallocated greenlets may be kept and handed out again.
+        import weakref
+        main = greenlet.getcurrent()
+        for _ in range(10):
+            g = greenlet(lambda: greenlet.getcurrent().parent.switch(), main)
+            g.attr = 1
+            ref = weakref.ref(g)
+            g.switch()
+            g.throw()
+            del g
+            self.assertIsNone(ref())
+        for _ in range(10):
+            g = greenlet()
+            self.assertFalse(hasattr(g, 'attr'))
+            self.assertEqual(g.__dict__, {})
+            self.assertIs(g.parent, main)
+            self.assertFalse(g)
+            self.assertFalse(g.dead)
+            self.assertIsNone(g.gr_frame)
+            self.assertIsNone(weakref.ref(g)().gr_frame)
+            with self.assertRaises(AttributeError):
+                getattr(g, 'run')
+
+    def test_subclass_with_slots(self):
+        # The layout of a greenlet object is fixed, so subclasses can
+        # still add slots.
+        class S(greenlet):
+            __slots__ = ('x', 'y')
+
+        def run():
+            g = greenlet.getcurrent()
+            return g.x + g.y
+
+        g = S(run)
+        g.x = 1
+        g.y = 2
+        self.assertEqual(g.switch(), 3)
+        self.assertTrue(g.dead)
+
     def test_two_children(self):
         lst = []
 
@@ -260,6 +318,142 @@ class TestGreenlet(TestCase):
             del seen[:]
             del someref[:]
 
+    def test_dealloc_many_other_thread(self):
+        # Greenlets released from another thread are all killed, in
+        # the order they were released, when their thread runs again.
+        seen = []
+        glets = []
+        created = threading.Event()
+        released = threading.Event()
+
+        def fmain(i):
+            try:
+                greenlet.getcurrent().parent.switch()
+            except greenlet.GreenletExit:
+                seen.append(i)
+
+        def f():
+            for i in range(10):
+                g = greenlet(fmain)
+                g.switch(i)
+                glets.append(g)
+            del g
+            created.set()
+            released.wait(10)
+            greenlet() # trigger release
+
+        t = threading.Thread(target=f)
+        t.start()
+        created.wait(10)
+        for i in (3, 1, 4, 0, 5, 9, 2, 6, 8, 7):
+            glets[i] = None
+        del glets[:]
+        self.assertEqual(seen, [])
+        released.set()
+        t.join(10)
+        self.assertEqual(seen, [3, 1, 4, 0, 5, 9, 2, 6, 8, 7])
+
+    # What the abandoned frames refer to is never released.
+    @fails_leakcheck
+    def test_dealloc_abandon(self):
+        from greenlet import enable_abandon_on_dealloc
+        seen = []
+        g1 = greenlet(fmain)
+        g2 = greenlet(fmain)
+        self.assertFalse(g1.abandon_on_dealloc)
+        g1.abandon_on_dealloc = True
+        self.assertTrue(g1.abandon_on_dealloc)
+        g1.switch(seen)
+        g2.switch(seen)
+        # Thrown away without being switched to.
+        del g1
+        self.assertEqual(seen, [])
+        self.assertFalse(enable_abandon_on_dealloc(True))
+        try:
+            del g2
+        finally:
+            self.assertTrue(enable_abandon_on_dealloc(False))
+        self.assertEqual(seen, [])
+        # Greenlets that aren't suspended have nothing to abandon.
+        g3 = greenlet(fmain)
+        g3.abandon_on_dealloc = True
+        g3.switch(seen)
+        g3.throw(greenlet.GreenletExit)
+        self.assertEqual(seen, [greenlet.GreenletExit])
+
+    @fails_leakcheck
+    def test_dealloc_abandon_partly_saved(self):
+        # A greenlet can be thrown away while part of its stack is
+        # still in place, and the greenlet that's running has its
+        # own stack just below that.
+        main = greenlet.getcurrent()
+        glets = {}
+        seen = []
+
+        def deep(n, then):
+            if n:
+                return next(map(deep, (n - 1,), (then,)))
+            return then()
+
+        def b():
+            main.switch()
+            # Resumed from X, which C started; C is the last one on
+            # the stack above us.
+            glets['d'].parent = main
+            del glets['c']
+            return 'b'
+
+        def c(_):
+            try:
+                greenlet(lambda: glets['b'].switch(), parent=main).switch()
+            finally:
+                seen.append('c')
+
+        glets['b'] = greenlet(b)
+        deep(20, glets['b'].switch)
+        glets['c'] = greenlet(c)
+        glets['c'].abandon_on_dealloc = True
+        # C is started by D finishing, so nothing but *glets* and D
+        # holds on to it.
+        glets['d'] = greenlet(lambda: None, parent=glets['c'])
+        self.assertEqual(glets['d'].switch(), 'b')
+        self.assertEqual(seen, [])
+        self.assertEqual(list(glets), ['b', 'd'])
+        # Switching around works as usual.
+        for _ in range(10):
+            g = greenlet(lambda: deep(30, main.switch))
+            g.switch()
+            g.switch()
+            self.assertTrue(g.dead)
+
+    # Before 3.11, the greenlet is still abandoned, and leaks.
+    @ignores_leakcheck
+    def test_dealloc_abandon_frame_referenced(self):
+        from greenlet import trim_stack_pool
+        saved = []
+        def f():
+            try:
+                saved.append(sys._getframe())
+                greenlet.getcurrent().parent.switch()
+            finally:
+                saved.append('finally')
+        g = greenlet(f)
+        g.abandon_on_dealloc = True
+        g.switch()
+        del g
+        trim_stack_pool()
+        # Reuse whatever memory the greenlet had.
+        for _ in range(10):
+            greenlet(lambda: [sys._getframe() for _ in range(10)]).switch()
+        frame = saved.pop(0)
+        self.assertEqual(frame.f_code.co_name, 'f')
+        if sys.version_info[:2] >= (3, 11):
+            # Its frame chunks would have outlived the frame, so it
+            # was killed instead of being thrown away.
+            self.assertEqual(saved, ['finally'])
+        else:
+            self.assertEqual(saved, [])
+
     def test_frame(self):
         def f1():
             f = sys._getframe(0) # pylint:disable=protected-access
@@ -305,6 +499,23 @@ class TestGreenlet(TestCase):
         self.assertEqual(((2,), {'x': 3}), g.switch())
         self.assertEqual((3, 9), g.switch())
 
+    def test_switch_one_arg(self):
+        def run(x):
+            self.assertEqual(x, (1,))
+            y = greenlet.getcurrent().parent.switch((2,))
+            self.assertEqual(y, ())
+            y = greenlet.getcurrent().parent.switch()
+            self.assertEqual(y, (3, 4))
+            return (5,)
+        g = greenlet(run)
+        self.assertEqual(g.switch((1,)), (2,))
+        self.assertEqual(g.switch(()), ())
+        self.assertEqual(g.switch(3, 4), (5,))
+        self.assertTrue(g.dead)
+        # Switching to a dead greenlet just returns the arguments.
+        self.assertEqual(g.switch((6,)), (6,))
+        self.assertEqual(g.switch(7), 7)
+
     def test_switch_to_another_thread(self):
         data = {}
         created_event = threading.Event()
@@ -945,6 +1156,36 @@ class TestGreenletSetParentErrors(TestCase):
             # XXX: Should handle this automatically.
             del another[:]
 
+    def test_reparenting_unstarted_ancestor_to_thread_running(self):
+        # An unstarted greenlet whose unstarted parent is later moved
+        # to another thread can't be switched to from here either.
+        another = []
+        switched_to_greenlet = threading.Event()
+        keep_main_alive = threading.Event()
+        def worker():
+            g = greenlet(lambda: None)
+            another.append(g)
+            g.switch()
+            switched_to_greenlet.set()
+            keep_main_alive.wait(10)
+
+        t = threading.Thread(target=worker)
+        t.start()
+
+        switched_to_greenlet.wait(10)
+        try:
+            middle = greenlet(lambda: None)
+            g = greenlet(lambda: None, middle)
+            middle.parent = another[0]
+
+            with self.assertRaises(greenlet.error) as exc:
+                g.switch()
+            self.assertEqual(str(exc.exception), "cannot switch to a different thread")
+        finally:
+            keep_main_alive.set()
+            t.join(10)
+            del another[:]
+
     def test_cannot_delete_parent(self):
         worker = greenlet(lambda: None)
         self.assertIs(worker.parent, greenlet.getcurrent())
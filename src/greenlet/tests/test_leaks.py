@@ -302,6 +302,74 @@ class TestLeaks(TestCase):
             manually_collect_background=False,
             explicit_reference_to_switch=True)
 
+    def _abandon_switch_to_main(self, run):
+        # Leave a greenlet suspended in a switch into the main
+        # greenlet of a thread, and delete it after the thread exits,
+        # so it is never resumed. Return a weakref to that main greenlet.
+        main_wrefs = []
+        glets = []
+        glet_running = threading.Event()
+        def background_thread():
+            glet = greenlet.greenlet(run)
+            main_wrefs.append(weakref.ref(glet.parent))
+            glets.append(glet)
+            glet.switch()
+            del glet
+            glet_running.set()
+
+        t = threading.Thread(target=background_thread)
+        t.start()
+        glet_running.wait(10)
+        t.join(10)
+        del t
+        del glets[:]
+        self.wait_for_pending_cleanups()
+        return main_wrefs[0]
+
+    @fails_leakcheck
+    def test_abandoned_switch_releases_main_greenlet(self):
+        # Nothing but the frame's value stack may refer to the main
+        # greenlet, so no local variables. (The rest of the
+        # abandoned frame still leaks.)
+        def run():
+            greenlet.getcurrent().parent.switch()
+        main = self._abandon_switch_to_main(run)
+        self.assertIsNone(main())
+
+    @fails_leakcheck
+    def test_abandoned_unbound_switch_releases_main_greenlet(self):
+        def run():
+            greenlet.greenlet.switch(greenlet.getcurrent().parent, 1)
+        main = self._abandon_switch_to_main(run)
+        self.assertIsNone(main())
+
+    @fails_leakcheck
+    def test_abandoned_bound_switch_releases_main_greenlet(self):
+        # The frame holds the bound method, which holds the main
+        # greenlet.
+        def run():
+            getattr(greenlet.getcurrent().parent, 'switch')()
+        main = self._abandon_switch_to_main(run)
+        self.assertIsNone(main())
+
+    @fails_leakcheck
+    def test_abandoned_bound_switch_variable(self):
+        def run():
+            switch = greenlet.getcurrent().parent.switch
+            switch()
+        main = self._abandon_switch_to_main(run)
+        gc.collect()
+        if sys.version_info[:2] < (3, 11):
+            # Freeing the abandoned frame releases its variables.
+            self.assertIsNone(main())
+        else:
+            # The frame's variables are lost with it, including the
+            # bound method, which still refers to the main greenlet.
+            # That's a leak, but the main greenlet must not be freed
+            # out from under it.
+            self.assertIsNotNone(main())
+            self.assertTrue(main().dead)
+
     UNTRACK_ATTEMPTS = 100
 
     def _only_test_some_versions(self):
@@ -1,3 +1,7 @@
+import os
+import sys
+import unittest
+
 import greenlet
 from . import TestCase
 
@@ -17,3 +21,296 @@ class Test(TestCase):
         self.assertGreater(g._stack_saved, 0)
         g.switch()
         self.assertEqual(g._stack_saved, 0)
+
+    def test_trim_stack_pool(self):
+        main = greenlet.getcurrent()
+
+        def func():
+            main.switch()
+
+        greenlet.trim_stack_pool()
+        g = greenlet.greenlet(func)
+        g.switch()
+        self.assertGreater(g._stack_saved, 0)
+        # Resuming gives the buffer back to the pool...
+        g.switch()
+        self.assertTrue(g.dead)
+        self.assertGreater(greenlet.trim_stack_pool(), 0)
+        # ...which is now empty.
+        self.assertEqual(greenlet.trim_stack_pool(), 0)
+
+    @unittest.skipIf(sys.version_info[:2] < (3, 11),
+                     "Frames don't share a data stack before 3.11")
+    def test_trim_stack_pool_frame_chunks(self):
+        def func():
+            return 42
+
+        greenlet.trim_stack_pool()
+        self.assertEqual(greenlet.greenlet(func).switch(), 42)
+        # The finished greenlet's frame memory was kept (it's at least
+        # 16KB)...
+        pooled = greenlet.trim_stack_pool()
+        self.assertGreaterEqual(pooled, 16 * 1024)
+        # ...and greenlets started one after another keep reusing the
+        # same memory.
+        for _ in range(3):
+            self.assertEqual(greenlet.greenlet(func).switch(), 42)
+        self.assertEqual(greenlet.trim_stack_pool(), pooled)
+
+    def test_stack_copy_retention(self):
+        main = greenlet.getcurrent()
+
+        def func():
+            for _ in range(3):
+                main.switch()
+
+        greenlet.enable_stack_copy_retention(True)
+        try:
+            before = greenlet.get_stack_stats()
+            g = greenlet.greenlet(func)
+            for _ in range(4):
+                g.switch()
+            after = greenlet.get_stack_stats()
+        finally:
+            greenlet.enable_stack_copy_retention(False)
+        self.assertTrue(g.dead)
+        self.assertGreater(after['bytes_saved'], before['bytes_saved'])
+        # Suspended in the same place each time, so most of the stack
+        # was unchanged after the first save.
+        self.assertGreater(after['bytes_skipped'], before['bytes_skipped'])
+
+    def test_stack_compression(self):
+        main = greenlet.getcurrent()
+
+        def deep(n):
+            if n:
+                return next(map(deep, (n - 1,)))
+            return main.switch(main._stack_saved)
+
+        old = greenlet.enable_stack_compression(2)
+        try:
+            before = greenlet.get_stack_stats()
+            idle = greenlet.greenlet(lambda: deep(20) + 1)
+            idle.switch()
+            saved = idle._stack_saved
+            # Switch around long enough for it to be compressed.
+            for _ in range(5):
+                greenlet.greenlet(main.switch).switch()
+            after = greenlet.get_stack_stats()
+            self.assertGreaterEqual(after['bytes_compressed'] - before['bytes_compressed'],
+                                    saved)
+            self.assertLess(after['bytes_compressed_to'] - before['bytes_compressed_to'],
+                            after['bytes_compressed'] - before['bytes_compressed'])
+            # It still has its whole stack.
+            self.assertEqual(idle._stack_saved, saved)
+            self.assertEqual(idle.switch(41), 42)
+            self.assertTrue(idle.dead)
+        finally:
+            self.assertEqual(greenlet.enable_stack_compression(old), 2)
+        with self.assertRaises(ValueError):
+            greenlet.enable_stack_compression(-1)
+
+    @unittest.skipIf(sys.platform == 'win32', "Spilling stacks needs mmap")
+    def test_stack_memory_limit(self):
+        main = greenlet.getcurrent()
+
+        def deep(n):
+            if n:
+                return next(map(deep, (n - 1,)))
+            x = main.switch()
+            return x + main.switch()
+
+        glets = [greenlet.greenlet(lambda: deep(20)) for _ in range(10)]
+        old = greenlet.set_stack_memory_limit(1)
+        try:
+            before = greenlet.get_stack_stats()
+            for g in glets:
+                g.switch()
+            after = greenlet.get_stack_stats()
+            self.assertGreater(after['bytes_spilled'], before['bytes_spilled'])
+            # Spilled stacks are read back transparently, and can be
+            # spilled again.
+            for g in glets:
+                g.switch(1)
+            self.assertEqual([g.switch(2) for g in glets], [3] * 10)
+        finally:
+            self.assertEqual(greenlet.set_stack_memory_limit(old), 1)
+        with self.assertRaises(ValueError):
+            greenlet.set_stack_memory_limit(-1)
+
+    def _check_stack_memory_limit_fork(self, parent_first):
+        main = greenlet.getcurrent()
+
+        def deep(n):
+            if n:
+                return next(map(deep, (n - 1,)))
+            x = main.switch()
+            return x + main.switch()
+
+        def new_glets():
+            return [greenlet.greenlet(lambda: deep(20)) for _ in range(10)]
+
+        def start(glets):
+            for g in glets:
+                g.switch()
+
+        def finish(glets, x):
+            for g in glets:
+                g.switch(1)
+            return [g.switch(x) for g in glets] == [x + 1] * len(glets)
+
+        def work(glets, x):
+            # Finish the spilled greenlets from before the fork, and
+            # spill and finish new ones, none of which may disturb the
+            # other process.
+            others = new_glets()
+            start(others)
+            return finish(glets, x) and finish(others, x)
+
+        glets = new_glets()
+        start(glets)
+        first, then = os.pipe()
+        pid = os.fork()
+        if not pid:
+            ok = False
+            try:
+                os.close(then)
+                if parent_first:
+                    os.read(first, 1)
+                ok = work(glets, 2)
+            finally:
+                os._exit(0 if ok else 1)
+        os.close(first)
+        try:
+            if parent_first:
+                self.assertTrue(work(glets, 4))
+        finally:
+            os.close(then)
+            _, status = os.waitpid(pid, 0)
+        self.assertEqual(status, 0)
+        if not parent_first:
+            self.assertTrue(work(glets, 4))
+
+    @unittest.skipUnless(hasattr(os, 'fork'), "Needs fork")
+    def test_stack_memory_limit_fork(self):
+        old = greenlet.set_stack_memory_limit(1)
+        try:
+            for retain in False, True:
+                old_retain = greenlet.enable_stack_copy_retention(retain)
+                try:
+                    self._check_stack_memory_limit_fork(parent_first=False)
+                    self._check_stack_memory_limit_fork(parent_first=True)
+                finally:
+                    greenlet.enable_stack_copy_retention(old_retain)
+        finally:
+            greenlet.set_stack_memory_limit(old)
+
+    def test_learned_stack_sizes(self):
+        main = greenlet.getcurrent()
+
+        def deep(n, then):
+            if n:
+                return next(map(deep, (n - 1,), (then,)))
+            return then()
+
+        def func():
+            me = greenlet.getcurrent()
+            # A child started near the top of our stack...
+            child = greenlet.greenlet(lambda: (me.switch(), main.switch()))
+            child.switch()
+            # ...is switched to from deep down, so our stack is saved
+            # a part at a time.
+            deep(40, lambda: greenlet.greenlet(child.switch).switch())
+
+        def grown():
+            before = greenlet.get_stack_stats()['buffers_grown']
+            g = greenlet.greenlet(func)
+            g.switch()
+            saved = g._stack_saved
+            g.throw(greenlet.GreenletExit)
+            self.assertTrue(g.dead)
+            return saved, greenlet.get_stack_stats()['buffers_grown'] - before
+
+        # (The leak checks run this test more than once.)
+        learned = func.__code__ in greenlet.get_learned_stack_sizes()
+        saved, count = grown()
+        if not learned:
+            self.assertGreater(count, 0)
+        self.assertGreaterEqual(greenlet.get_learned_stack_sizes()[func.__code__],
+                                saved)
+        # Later ones get a buffer that's big enough to begin with.
+        self.assertEqual(grown()[1], 0)
+
+    def test_learned_stack_sizes_adapt(self):
+        main = greenlet.getcurrent()
+
+        def deep(n):
+            if n:
+                return next(map(deep, (n - 1,)))
+            return main.switch()
+
+        def func(depth):
+            deep(depth)
+
+        def learn(depth):
+            g = greenlet.greenlet(func)
+            g.switch(depth)
+            g.switch()
+            return greenlet.get_learned_stack_sizes()[func.__code__]
+
+        big = learn(100)
+        # One deep greenlet doesn't decide the size for good.
+        small = learn(0)
+        self.assertLess(small, big)
+        self.assertLess(learn(0), small)
+        # Trimming forgets it.
+        greenlet.trim_stack_pool()
+        self.assertNotIn(func.__code__, greenlet.get_learned_stack_sizes())
+
+    def test_compact_stacks(self):
+        main = greenlet.getcurrent()
+
+        def deep(n):
+            if n:
+                return next(map(deep, (n - 1,)))
+            return main.switch()
+
+        def func(depth):
+            deep(depth)
+
+        # Teach it that func needs a lot of space...
+        g = greenlet.greenlet(func)
+        g.switch(100)
+        g.switch()
+        self.assertTrue(g.dead)
+        # ...so this one gets more than it needs.
+        g = greenlet.greenlet(func)
+        g.switch(0)
+        greenlet.trim_stack_pool()
+        before = greenlet.get_stack_stats()
+        reclaimed = greenlet.compact_stacks()
+        after = greenlet.get_stack_stats()
+        self.assertGreater(reclaimed, 0)
+        self.assertEqual(after['bytes_compacted'] - before['bytes_compacted'], reclaimed)
+        g.switch()
+        self.assertTrue(g.dead)
+
+    def test_compact_retained_stacks(self):
+        main = greenlet.getcurrent()
+
+        def func():
+            main.switch()
+            # We've been resumed, and have kept our copy.
+            greenlet.trim_stack_pool()
+            main.switch(greenlet.compact_stacks())
+
+        greenlet.enable_stack_copy_retention(True)
+        try:
+            g = greenlet.greenlet(func)
+            g.switch()
+            reclaimed = g.switch()
+            g.switch()
+        finally:
+            greenlet.enable_stack_copy_retention(False)
+        self.assertTrue(g.dead)
+        self.assertGreaterEqual(reclaimed, 512)
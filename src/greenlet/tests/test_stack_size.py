@@ -0,0 +1,194 @@
+import unittest
+
+import greenlet
+from greenlet import greenlet as RawGreenlet
+from . import TestCase
+
+# The smallest size allowed.
+STACK_SIZE = 4 * 1024 * 1024
+
+
+@unittest.skipUnless(greenlet._greenlet.GREENLET_USE_DEDICATED_STACKS,
+                     "Dedicated stacks not supported on this platform")
+class TestDedicatedStack(TestCase):
+
+    def test_nothing_saved(self):
+        main = greenlet.getcurrent()
+
+        def func():
+            main.switch(main._stack_saved)
+            return 42
+
+        g = RawGreenlet(func, stack_size=STACK_SIZE)
+        x = g.switch()
+        # Neither greenlet had to move out of the other's way.
+        self.assertEqual(x, 0)
+        self.assertEqual(g._stack_saved, 0)
+        self.assertEqual(g.switch(), 42)
+        self.assertTrue(g.dead)
+
+    def test_recursion(self):
+        def deep(n):
+            if n == 0:
+                return greenlet.getcurrent().parent.switch(n)
+            return deep(n - 1) + 1
+
+        g = RawGreenlet(lambda: deep(200), stack_size=STACK_SIZE)
+        self.assertEqual(g.switch(), 0)
+        self.assertEqual(g.switch(1), 201)
+
+    def test_recursion_limit_through_c(self):
+        # Recursing through C functions uses much more of the C stack
+        # than plain Python calls; it must still stop with a
+        # RecursionError, not overflow the stack.
+        def through_map(n):
+            return next(map(through_map, (n + 1,)))
+
+        def through_sorted(n):
+            return sorted([1], key=lambda _: through_sorted(n + 1))
+
+        for func in through_map, through_sorted:
+            g = RawGreenlet(func, stack_size=STACK_SIZE)
+            with self.assertRaises(RecursionError):
+                g.switch(0)
+
+    def test_shared_greenlets_inside(self):
+        # Greenlets started from a greenlet with its own stack share it.
+        def inner(x):
+            x = greenlet.getcurrent().parent.switch(x * 2)
+            return x + 1
+
+        def outer():
+            child = RawGreenlet(inner, stack_size=0)
+            a = child.switch(3)
+            greenlet.getcurrent().parent.switch(a)
+            return child.switch(10)
+
+        g = RawGreenlet(outer, stack_size=STACK_SIZE)
+        self.assertEqual(g.switch(), 6)
+        self.assertEqual(g.switch(), 11)
+        self.assertTrue(g.dead)
+
+    def test_mixed(self):
+        def func(i):
+            return greenlet.getcurrent().parent.switch(i) + i
+
+        glets = [RawGreenlet(func, stack_size=STACK_SIZE if i % 2 else 0)
+                 for i in range(10)]
+        self.assertEqual([g.switch(i) for i, g in enumerate(glets)],
+                         list(range(10)))
+        self.assertEqual([g.switch(1) for g in glets],
+                         [i + 1 for i in range(10)])
+
+    def test_exception(self):
+        def func():
+            raise KeyError(1)
+        with self.assertRaises(KeyError):
+            RawGreenlet(func, stack_size=STACK_SIZE).switch()
+
+    def test_kill_suspended(self):
+        seen = []
+
+        def func():
+            try:
+                greenlet.getcurrent().parent.switch()
+            except greenlet.GreenletExit:
+                seen.append(1)
+                raise
+
+        g = RawGreenlet(func, stack_size=STACK_SIZE)
+        g.switch()
+        del g
+        self.assertEqual(seen, [1])
+
+
+@unittest.skipUnless(greenlet._greenlet.GREENLET_USE_DEDICATED_STACKS,
+                     "Dedicated stacks not supported on this platform")
+class TestStackGroups(TestCase):
+
+    def _ping_pong(self, group1, group2):
+        def func():
+            other = greenlet.getcurrent().other
+            for _ in range(10):
+                other.switch()
+
+        a = RawGreenlet(func, stack_group=group1)
+        b = RawGreenlet(func, stack_group=group2)
+        a.other = b
+        b.other = a
+        before = greenlet.get_stack_stats()
+        a.switch()
+        after = greenlet.get_stack_stats()
+        self.assertTrue(a.dead)
+        b.switch()
+        self.assertTrue(b.dead)
+        del a.other, b.other
+        return {k: after[k] - before[k] for k in after}
+
+    def test_different_groups(self):
+        stats = self._ping_pong(0, 1)
+        self.assertEqual(stats['bytes_saved'], 0)
+        self.assertEqual(stats['switches_within_stack'], 0)
+        self.assertGreaterEqual(stats['switches_across_stacks'], 20)
+
+    def test_same_group(self):
+        stats = self._ping_pong(2, 2)
+        self.assertGreater(stats['bytes_saved'], 0)
+        self.assertGreaterEqual(stats['switches_within_stack'], 20)
+
+    def test_shared_greenlets_inside(self):
+        def inner(x):
+            return greenlet.getcurrent().parent.switch(x * 10) + 1
+
+        def worker(x):
+            y = greenlet.getcurrent().parent.switch(x)
+            child = RawGreenlet(inner)
+            v = child.switch(x)
+            return y + child.switch(v)
+
+        glets = [RawGreenlet(worker, stack_group=i % 3) for i in range(9)]
+        self.assertEqual([g.switch(i) for i, g in enumerate(glets)],
+                         list(range(9)))
+        self.assertEqual([g.switch(1) for g in glets],
+                         [i * 10 + 2 for i in range(9)])
+
+    def test_invalid(self):
+        for bad in (-1, 64):
+            with self.assertRaises(ValueError):
+                RawGreenlet(stack_group=bad)
+
+
+class TestStackSizeArguments(TestCase):
+
+    def test_invalid(self):
+        for bad in (-1, 100, STACK_SIZE - 1):
+            with self.assertRaises(ValueError):
+                RawGreenlet(stack_size=bad)
+            with self.assertRaises(ValueError):
+                greenlet.stack_size(bad)
+
+    def test_main_greenlet(self):
+        with self.assertRaises(ValueError):
+            greenlet.getcurrent().__init__(stack_size=0)
+
+    def test_started(self):
+        g = RawGreenlet(lambda: greenlet.getcurrent().parent.switch())
+        g.switch()
+        with self.assertRaises(ValueError):
+            g.__init__(stack_size=0)
+        g.throw(greenlet.GreenletExit)
+
+    @unittest.skipUnless(greenlet._greenlet.GREENLET_USE_DEDICATED_STACKS,
+                         "Dedicated stacks not supported on this platform")
+    def test_default(self):
+        main = greenlet.getcurrent()
+        old = greenlet.stack_size(STACK_SIZE)
+        try:
+            self.assertEqual(old, 0)
+            self.assertEqual(greenlet.stack_size(), STACK_SIZE)
+            g = RawGreenlet(lambda: main.switch(main._stack_saved))
+        finally:
+            greenlet.stack_size(old)
+        self.assertEqual(g.switch(), 0)
+        g.switch()
+        self.assertTrue(g.dead)
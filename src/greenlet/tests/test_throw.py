@@ -127,3 +127,149 @@ class ThrowTests(TestCase):
             )
         self.assertEqual(str(exc.exception),
                          "exceptions must be classes, or instances, not str")
+
+    def test_too_many_arguments(self):
+        with self.assertRaises(TypeError):
+            greenlet.getcurrent().throw(Exception, Exception(), None, None)
+        with self.assertRaises(TypeError):
+            greenlet.getcurrent().throw(typ=Exception)
+
+    def test_killall(self):
+        from greenlet import killall
+        main = greenlet.getcurrent()
+
+        def f():
+            try:
+                switch("ok")
+            except RuntimeError:
+                return "caught"
+
+        def g():
+            switch("ok")
+
+        def h():
+            # Dies by raising something else.
+            try:
+                switch("ok")
+            finally:
+                raise IndexError
+
+        def other_parent():
+            main.switch("ok")
+
+        glets = [greenlet(f), greenlet(g), greenlet(h), greenlet(f)]
+        for glet in glets[:3]:
+            self.assertEqual(glet.switch(), "ok")
+        # Each one comes back to us, not to its parent.
+        parent = greenlet(main.switch)
+        glets.append(greenlet(other_parent, parent=parent))
+        self.assertEqual(glets[-1].switch(), "ok")
+
+        exc = RuntimeError("ciao")
+        results = killall(iter(glets), exc)
+        self.assertEqual(len(results), 5)
+        self.assertEqual(results[0], "caught")
+        self.assertIs(results[1], exc)
+        self.assertIsInstance(results[2], IndexError)
+        self.assertIsNotNone(results[2].__traceback__)
+        # Never started, so it never got to catch it.
+        self.assertIs(results[3], exc)
+        self.assertIs(results[4], exc)
+        # Though raised through several greenlets, it wasn't changed.
+        self.assertIsNone(exc.__traceback__)
+        self.assertIsNone(exc.__context__)
+        self.assertTrue(all(glet.dead for glet in glets))
+        self.assertIs(glets[-1].parent, parent)
+
+        # The already dead eat GreenletExit.
+        results = killall(glets[:2])
+        self.assertIsInstance(results[0], greenlet.GreenletExit)
+        self.assertIsInstance(results[1], greenlet.GreenletExit)
+
+    def test_killall_class(self):
+        from greenlet import killall
+        import traceback
+
+        def a():
+            switch("ok")
+
+        def b():
+            try:
+                switch("ok")
+            except ValueError:
+                raise
+
+        glets = [greenlet(a), greenlet(b)]
+        for glet in glets:
+            self.assertEqual(glet.switch(), "ok")
+        results = killall(glets, ValueError)
+        # Each got an exception of its own, with its own traceback.
+        self.assertIsNot(results[0], results[1])
+        names = [[frame.name for frame in traceback.extract_tb(r.__traceback__)]
+                 for r in results]
+        self.assertIn('a', names[0])
+        self.assertNotIn('b', names[0])
+        self.assertIn('b', names[1])
+        self.assertNotIn('a', names[1])
+
+    def test_killall_errors(self):
+        from greenlet import killall
+        glet = greenlet(switch)
+        glet.switch()
+        with self.assertRaises(TypeError):
+            killall(42)
+        with self.assertRaises(TypeError):
+            killall([glet, 42])
+        with self.assertRaises(TypeError):
+            killall([glet], "abc")
+        # Nothing was thrown.
+        self.assertFalse(glet.dead)
+        self.assertEqual(killall([]), [])
+        # Killing ourself raises the exception here, like throw().
+        exc, = killall([greenlet.getcurrent()], IndexError)
+        self.assertIsInstance(exc, IndexError)
+        exc, = killall([glet])
+        self.assertIsInstance(exc, greenlet.GreenletExit)
+        self.assertTrue(glet.dead)
+
+    def test_killall_ancestor(self):
+        # Like throw(), killing a greenlet we descend from switches to
+        # it, and it goes back to its own parent.
+        from greenlet import killall
+
+        def run_outer():
+            child = greenlet(lambda: killall([outer]))
+            child.switch()
+
+        outer = greenlet(run_outer)
+        result = outer.switch()
+        self.assertIsInstance(result, greenlet.GreenletExit)
+        self.assertTrue(outer.dead)
+        self.assertIs(outer.parent, greenlet.getcurrent())
+
+    def test_killall_other_thread(self):
+        import threading
+        from greenlet import killall
+        glets = []
+        started = threading.Event()
+        done = threading.Event()
+
+        def f():
+            glets.append(greenlet(switch))
+            glets[0].switch()
+            started.set()
+            done.wait(10)
+            del glets[:]
+
+        t = threading.Thread(target=f)
+        t.start()
+        started.wait(10)
+        try:
+            exc, = killall(glets)
+            # The same error throw() raises.
+            self.assertIsInstance(exc, greenlet.error)
+            with self.assertRaises(greenlet.error):
+                glets[0].throw()
+        finally:
+            done.set()
+            t.join(10)